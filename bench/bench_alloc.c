@@ -0,0 +1,48 @@
+/*
+ * bench_alloc: one timed trial of a mixed mmalloc/mfree workload.
+ *
+ *   bench_alloc [ops]
+ *
+ * Prints the mean cost of an operation in ns as the last line, which is
+ * what bench_compare reads. Tunables come from DM_ALLOC_CONF.
+ *
+ *   gcc -O2 -Iinclude bench/bench_alloc.c src/dm_alloc.c -o bench_alloc
+ */
+
+#include "dm_alloc.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+#define WINDOW 512
+
+static const size_t SIZES[] = {16, 24, 32, 48, 64, 128, 256, 1024, 4096};
+
+int main(int argc, char **argv)
+{
+    long ops = argc > 1 ? atol(argv[1]) : 200000;
+    static void *live[WINDOW];
+    uint32_t seed = 12345; // fixed, every trial runs the same sequence
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < ops; i++)
+    {
+        seed = seed * 1103515245u + 12345u;
+        size_t slot = (seed >> 8) % WINDOW;
+        if (live[slot])
+        {
+            mfree(live[slot]);
+            live[slot] = NULL;
+        }
+        else
+        {
+            live[slot] = mmalloc(SIZES[(seed >> 20) % (sizeof(SIZES) / sizeof(SIZES[0]))]);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    printf("%.3f\n", ns / ops);
+    return 0;
+}
@@ -0,0 +1,262 @@
+/*
+ * bench_compare: decide whether two benchmark commands really differ.
+ *
+ *   bench_compare [-n trials] [-w warmup] [-c cpu] "command A" "command B"
+ *
+ * Each command is run through /bin/sh and must print its measurement as the
+ * last number of its output (bench_alloc does). Trials alternate A B B A so
+ * slow drift of the machine hits both sides alike, warmup trials are thrown
+ * away, and every run is pinned to `cpu`. The report gives the mean and 95%
+ * confidence interval of each side, the relative difference with its
+ * interval, and the p-value of Welch's t-test.
+ *
+ * Two builds:  bench_compare ./bench_alloc.old ./bench_alloc
+ * Two configs: bench_compare ./bench_alloc "DM_ALLOC_CONF=coalesce:lazy ./bench_alloc"
+ *
+ *   gcc -O2 bench/bench_compare.c -o bench_compare -lm
+ */
+
+#define _GNU_SOURCE
+#include <math.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MAX_TRIALS 1000
+
+/**
+ * @brief run `cmd` pinned to `cpu` and parse the last number it printed.
+ *
+ * @return 0 on success, -1 if the command failed or printed no number
+ */
+static int run_trial(const char *cmd, int cpu, double *out)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+        return -1;
+    pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0)
+    {
+        if (cpu >= 0)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            sched_setaffinity(0, sizeof(set), &set);
+        }
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+
+    close(fds[1]);
+    char buf[4096];
+    size_t len = 0;
+    ssize_t n;
+    while ((n = read(fds[0], buf + len, sizeof(buf) - 1 - len)) > 0)
+    {
+        len += n;
+        if (len == sizeof(buf) - 1)
+        {
+            // keep only the tail, the number is at the end
+            memmove(buf, buf + len / 2, len - len / 2);
+            len -= len / 2;
+        }
+    }
+    close(fds[0]);
+    buf[len] = '\0';
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+
+    // walk back to the start of the last token
+    while (len > 0 && strchr(" \t\r\n", buf[len - 1]))
+        buf[--len] = '\0';
+    while (len > 0 && !strchr(" \t\r\n", buf[len - 1]))
+        len--;
+    char *end;
+    *out = strtod(buf + len, &end);
+    return end == buf + len ? -1 : 0;
+}
+
+/**
+ * @brief continued fraction of the incomplete beta function.
+ */
+static double beta_cf(double a, double b, double x)
+{
+    const double tiny = 1e-300;
+    double c = 1, d = 1 - (a + b) * x / (a + 1);
+    if (fabs(d) < tiny)
+        d = tiny;
+    d = 1 / d;
+    double h = d;
+    for (int m = 1; m <= 300; m++)
+    {
+        double m2 = 2.0 * m;
+        double aa = m * (b - m) * x / ((a + m2 - 1) * (a + m2));
+        d = 1 + aa * d;
+        d = fabs(d) < tiny ? tiny : d;
+        c = 1 + aa / c;
+        c = fabs(c) < tiny ? tiny : c;
+        d = 1 / d;
+        h *= d * c;
+        aa = -(a + m) * (a + b + m) * x / ((a + m2) * (a + m2 + 1));
+        d = 1 + aa * d;
+        d = fabs(d) < tiny ? tiny : d;
+        c = 1 + aa / c;
+        c = fabs(c) < tiny ? tiny : c;
+        d = 1 / d;
+        double del = d * c;
+        h *= del;
+        if (fabs(del - 1) < 1e-12)
+            break;
+    }
+    return h;
+}
+
+/**
+ * @brief regularized incomplete beta function I_x(a, b).
+ */
+static double inc_beta(double a, double b, double x)
+{
+    if (x <= 0)
+        return 0;
+    if (x >= 1)
+        return 1;
+    double front = exp(lgamma(a + b) - lgamma(a) - lgamma(b) + a * log(x) + b * log(1 - x));
+    if (x < (a + 1) / (a + b + 2))
+        return front * beta_cf(a, b, x) / a;
+    return 1 - front * beta_cf(b, a, 1 - x) / b;
+}
+
+/**
+ * @brief two sided p-value of Student's t with `df` degrees of freedom.
+ */
+static double t_pvalue(double t, double df)
+{
+    return inc_beta(df / 2, 0.5, df / (df + t * t));
+}
+
+/**
+ * @brief t such that a two sided interval at `t` covers 95%.
+ */
+static double t_crit95(double df)
+{
+    double lo = 0, hi = 100;
+    for (int i = 0; i < 100; i++)
+    {
+        double mid = (lo + hi) / 2;
+        if (t_pvalue(mid, df) > 0.05)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return (lo + hi) / 2;
+}
+
+/**
+ * @brief mean and sample variance of `n` values.
+ */
+static void moments(const double *v, int n, double *mean, double *var)
+{
+    double m = 0, s = 0;
+    for (int i = 0; i < n; i++)
+        m += v[i];
+    m /= n;
+    for (int i = 0; i < n; i++)
+        s += (v[i] - m) * (v[i] - m);
+    *mean = m;
+    *var = n > 1 ? s / (n - 1) : 0;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: bench_compare [-n trials] [-w warmup] [-c cpu] \"command A\" \"command B\"\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    int trials = 30, warmup = 2, cpu = -1;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:w:c:")) != -1)
+    {
+        if (opt == 'n')
+            trials = atoi(optarg);
+        else if (opt == 'w')
+            warmup = atoi(optarg);
+        else if (opt == 'c')
+            cpu = atoi(optarg);
+        else
+            usage();
+    }
+    if (argc - optind != 2 || trials < 2 || trials > MAX_TRIALS || warmup < 0)
+        usage();
+    if (cpu < 0)
+        cpu = sched_getcpu();
+
+    const char *cmd[2] = {argv[optind], argv[optind + 1]};
+    static double samples[2][MAX_TRIALS];
+    int count[2] = {0, 0};
+
+    for (int i = 0; i < warmup; i++)
+    {
+        double ignored;
+        for (int side = 0; side < 2; side++)
+            if (run_trial(cmd[side], cpu, &ignored) != 0)
+            {
+                fprintf(stderr, "bench_compare: \"%s\" failed\n", cmd[side]);
+                return 1;
+            }
+    }
+
+    for (int i = 0; i < trials; i++)
+    {
+        // A B on even rounds, B A on odd ones
+        for (int k = 0; k < 2; k++)
+        {
+            int side = (i & 1) ? 1 - k : k;
+            double v;
+            if (run_trial(cmd[side], cpu, &v) != 0)
+            {
+                fprintf(stderr, "bench_compare: \"%s\" failed\n", cmd[side]);
+                return 1;
+            }
+            samples[side][count[side]++] = v;
+        }
+    }
+
+    double mean[2], var[2];
+    printf("cpu %d, %d trials each, %d warmup\n\n", cpu, trials, warmup);
+    for (int side = 0; side < 2; side++)
+    {
+        moments(samples[side], count[side], &mean[side], &var[side]);
+        double half = t_crit95(count[side] - 1) * sqrt(var[side] / count[side]);
+        printf("%c: %12.4f +- %-10.4f (95%% CI)  %s\n", 'A' + side, mean[side], half, cmd[side]);
+    }
+
+    // Welch's t-test, Welch-Satterthwaite degrees of freedom
+    double sa = var[0] / count[0], sb = var[1] / count[1];
+    double se = sqrt(sa + sb);
+    double df = (sa + sb) * (sa + sb) /
+                (sa * sa / (count[0] - 1) + sb * sb / (count[1] - 1));
+    double diff = mean[1] - mean[0];
+    double t = se > 0 ? diff / se : 0;
+    double p = se > 0 ? t_pvalue(t, df) : 1;
+    double half = se > 0 ? t_crit95(df) * se : 0;
+
+    printf("\nB - A: %+.4f (%+.2f%%), 95%% CI [%+.2f%%, %+.2f%%]\n", diff,
+           100 * diff / mean[0], 100 * (diff - half) / mean[0], 100 * (diff + half) / mean[0]);
+    printf("Welch t = %.3f, df = %.1f, p = %.4g -> %s\n", t, df, p,
+           p < 0.05 ? "significant at 5%" : "not significant at 5%");
+    return 0;
+}
@@ -0,0 +1,78 @@
+// Compares dm::vector / dm::string growth with std::vector / std::string
+// using dm::allocator, so both sides allocate from the same heap.
+//
+//   gcc -O2 -c -Iinclude src/dm_alloc.c src/dm_arena.c
+//   g++ -O2 -Iinclude bench/bench_containers.cpp dm_alloc.o dm_arena.o -lpthread
+
+#include "dm_alloc.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using bench_clock = std::chrono::steady_clock;
+
+template <typename F>
+static double time_ns(F f)
+{
+    auto start = bench_clock::now();
+    f();
+    return std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+}
+
+int main()
+{
+    const int rounds = 200;
+    const int pushes = 10000;
+    unsigned long sink = 0;
+
+    double std_vec = time_ns([&] {
+        for (int r = 0; r < rounds; r++)
+        {
+            std::vector<int, dm::allocator<int>> v;
+            for (int i = 0; i < pushes; i++)
+                v.push_back(i);
+            sink += v.size();
+        }
+    });
+
+    double dm_vec = time_ns([&] {
+        for (int r = 0; r < rounds; r++)
+        {
+            dm::vector<int> v;
+            for (int i = 0; i < pushes; i++)
+                v.push_back(i);
+            sink += v.size();
+        }
+    });
+
+    using std_string = std::basic_string<char, std::char_traits<char>, dm::allocator<char>>;
+    double std_str = time_ns([&] {
+        for (int r = 0; r < rounds; r++)
+        {
+            std_string s;
+            for (int i = 0; i < pushes; i++)
+                s.append("abcdefg", 7);
+            sink += s.size();
+        }
+    });
+
+    double dm_str = time_ns([&] {
+        for (int r = 0; r < rounds; r++)
+        {
+            dm::string s;
+            for (int i = 0; i < pushes; i++)
+                s.append("abcdefg", 7);
+            sink += s.size();
+        }
+    });
+
+    double ops = (double)rounds * pushes;
+    printf("std::vector push_back : %.2f ns/op\n", std_vec / ops);
+    printf("dm::vector  push_back : %.2f ns/op\n", dm_vec / ops);
+    printf("std::string append    : %.2f ns/op\n", std_str / ops);
+    printf("dm::string  append    : %.2f ns/op\n", dm_str / ops);
+    printf("(%lu)\n", sink);
+    return 0;
+}
@@ -8,6 +8,11 @@
 #include <string.h> //memset 
 #include <errno.h>
 
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
 /**
  * @brief This is the whole allocated memory acting as a linked list.
  * @param size  the total memory size for data allocation.
@@ -23,15 +28,224 @@ typedef struct BlockHeader
     struct BlockHeader *next; // next block in linked list
 } BlockHeader;
 
-BlockHeader *append(void *mem_ptr, size_t size);
+/**
+ * @brief allocator counters, see dm_get_stats.
+ * @param mapped_bytes bytes obtained from the OS through sbrk.
+ * @param reused_bytes bytes served from blocks that were already in the heap
+ * (free blocks found by find_free and the free tail grown in place).
+ * @param sbrk_calls number of times the heap was grown.
+ * @param map_calls mmap and munmap calls of mapped blocks, plus mprotect
+ * calls committing class region memory.
+ * @param purged_bytes bytes of free blocks released by dm_purge.
+ * @param heap_bytes bytes currently between the heap start and the break.
+ * @param peak_heap_bytes highest heap_bytes so far.
+ * @param trimmed_bytes bytes given back by lowering the break.
+ * @param in_use_bytes payload bytes of blocks in use.
+ * @param blocks blocks in the list, free or not.
+ * @param used_blocks blocks in use.
+ * @param skipped_frees mfree calls ignored after dm_begin_shutdown.
+ * @param cow_deferred_frees frees of inherited blocks kept in the side set.
+ * @param region_bytes bytes committed in the class regions.
+ * @param region_in_use_bytes bytes of class region blocks in use.
+ * @param mmap_blocks blocks with a mapping of their own (dm_malloc_numa).
+ * @param mmap_bytes bytes of those mappings.
+ * @param mmap_peak_blocks, mmap_peak_bytes highest mmap_blocks and mmap_bytes so far.
+ * @param budget_waits dm_malloc_wait calls that had to wait.
+ * @param budget_timeouts waits that ended without memory.
+ * @param budget_wait_ns total time spent waiting.
+ * @param budget_max_wait_ns longest single wait that got memory.
+ */
+typedef struct HeapStats
+{
+    size_t mapped_bytes;
+    size_t reused_bytes;
+    size_t sbrk_calls;
+    size_t map_calls;
+    size_t purged_bytes;
+    size_t heap_bytes;
+    size_t peak_heap_bytes;
+    size_t trimmed_bytes;
+    size_t in_use_bytes;
+    size_t blocks;
+    size_t used_blocks;
+    size_t skipped_frees;
+    size_t cow_deferred_frees;
+    size_t region_bytes;
+    size_t region_in_use_bytes;
+    size_t mmap_blocks;
+    size_t mmap_bytes;
+    size_t mmap_peak_blocks;
+    size_t mmap_peak_bytes;
+    size_t budget_waits;
+    size_t budget_timeouts;
+    uint64_t budget_wait_ns;
+    uint64_t budget_max_wait_ns;
+} HeapStats;
+
+/**
+ * @brief same fields as glibc's struct mallinfo2, see dm_mallinfo2.
+ */
+typedef struct DmMallinfo
+{
+    size_t arena;    // bytes taken from sbrk or committed in class regions
+    size_t ordblks;  // free blocks
+    size_t smblks;   // always 0, there are no fastbins
+    size_t hblks;    // blocks from dm_malloc_numa
+    size_t hblkhd;   // bytes mapped for them
+    size_t usmblks;  // always 0
+    size_t fsmblks;  // always 0
+    size_t uordblks; // payload bytes in use
+    size_t fordblks; // payload bytes free
+    size_t keepcost; // free bytes at the top that malloc_trim could release
+} DmMallinfo;
+
+/** mallopt parameters, same values as glibc's <malloc.h> */
+enum
+{
+    DM_M_TRIM_THRESHOLD = -1,
+    DM_M_TOP_PAD = -2,
+    DM_M_MMAP_THRESHOLD = -3,
+    DM_M_MMAP_MAX = -4
+};
+
+/** fit policies for HeapConfig.fit */
+enum
+{
+    DM_FIT_FIRST = 0,
+    DM_FIT_BEST = 1
+};
+
+/**
+ * @brief allocator tunables, see dm_configure.
+ * @param fit DM_FIT_FIRST or DM_FIT_BEST.
+ * @param lazy_coalesce 1 to merge free blocks only when an allocation misses.
+ * @param grow minimum bytes requested from sbrk at a time.
+ * @param trim free bytes at the top that make mfree lower the break, 0 never.
+ * @param profile warm-up profile path, empty for none.
+ * @param fast_exit 1 to enter dm_begin_shutdown from an atexit hook.
+ * @param cow 1 so forked children keep inherited headers untouched.
+ * @param lifetime sample one allocation in this many for lifetimes, 0 off.
+ * @param classes 1 to serve small blocks from headerless class regions.
+ * @param numa_nodes fake NUMA node count for testing, 0 for the real one.
+ * @param budget bytes in use allocations may not exceed, 0 for no limit.
+ */
+typedef struct HeapConfig
+{
+    int fit;
+    int lazy_coalesce;
+    size_t grow;
+    size_t trim;
+    char profile[256];
+    int fast_exit;
+    int cow;
+    size_t lifetime;
+    int classes;
+    size_t numa_nodes;
+    size_t budget;
+} HeapConfig;
+
+/** how dm_ws_mark_idle tracks page accesses */
+enum
+{
+    DM_WS_MINCORE,    // residency only, every resident page counts as hot
+    DM_WS_SOFT_DIRTY, // pages written since the mark are hot
+    DM_WS_PAGE_IDLE   // pages read or written since the mark are hot
+};
+
+/**
+ * @brief heap working set, see dm_ws_sample.
+ * @param method DM_WS_* used since the last dm_ws_mark_idle.
+ * @param resident_bytes heap pages in memory.
+ * @param hot_bytes resident heap pages touched since the mark.
+ * @param cold_bytes resident heap pages untouched since the mark.
+ * @param free_resident_bytes resident pages inside free blocks, what dm_purge would release.
+ */
+typedef struct DmWorkingSet
+{
+    int method;
+    size_t resident_bytes;
+    size_t hot_bytes;
+    size_t cold_bytes;
+    size_t free_resident_bytes;
+} DmWorkingSet;
+
+/** how dm_collapse_hot asked for huge pages */
+enum
+{
+    DM_COLLAPSE_SYNC, // MADV_COLLAPSE, done when the call returns
+    DM_COLLAPSE_HINT  // MADV_HUGEPAGE, khugepaged collapses later
+};
+
+/**
+ * @brief outcome of dm_collapse_hot.
+ * @param method DM_COLLAPSE_* used.
+ * @param candidates dense, resident 2 MiB ranges found.
+ * @param collapsed_bytes bytes the kernel accepted the request for.
+ * @param huge_before, huge_after AnonHugePages of the heap mappings.
+ */
+typedef struct DmCollapseReport
+{
+    int method;
+    size_t candidates;
+    size_t collapsed_bytes;
+    size_t huge_before;
+    size_t huge_after;
+} DmCollapseReport;
+
+/** placement policies of dm_malloc_numa */
+#define DM_NUMA_LOCAL (-1)
+#define DM_NUMA_INTERLEAVE (-2)
+#define DM_NUMA_NODE(n) (n)
+
+/** destructive interference size, the padding unit of dm_alloc_padded_array */
+#if !defined(DM_CACHE_LINE)
+#if defined(__aarch64__) && defined(__APPLE__)
+#define DM_CACHE_LINE 128
+#else
+#define DM_CACHE_LINE 64
+#endif
+#endif
+
+/** number of power of two size classes tracked for warm-up profiles */
+#define DM_CLASSES 48
+
 void *mmalloc(size_t size);
 void *mcalloc(size_t num, size_t size);
+void *dm_malloc_wait(size_t size, long timeout_ms);
 void *mrelloc(void *ptr, size_t size);
-BlockHeader *split_block(BlockHeader *block, size_t size);
-BlockHeader *find_free(size_t size);
-void coalesce();
+void *dm_aligned_alloc(size_t align, size_t size);
+void *dm_alloc_padded_array(size_t count, size_t elem_size);
+size_t dm_padded_stride(size_t elem_size);
+void *dm_malloc_numa(size_t size, int policy);
+long dm_numa_residency(void *ptr, size_t *per_node, int max_nodes);
 void mfree(void *ptr);
 void print_heap();
+void dm_get_stats(HeapStats *out);
+size_t dm_malloc_usable_size(void *ptr);
+int dm_try_expand(void *ptr, size_t size);
+size_t dm_purge();
+int dm_ws_mark_idle();
+int dm_ws_sample(DmWorkingSet *out);
+int dm_collapse_hot(size_t budget, DmCollapseReport *out);
+int dm_configure(const char *conf);
+void dm_get_config(HeapConfig *out);
+DmMallinfo dm_mallinfo2();
+void dm_malloc_stats();
+int dm_malloc_trim(size_t pad);
+int dm_mallopt(int param, int value);
+int dm_malloc_info(int options, FILE *stream);
+int dm_warmup(const size_t *sizes, const size_t *counts, size_t n);
+void dm_begin_shutdown();
+void dm_lifetime_dump(FILE *out);
+size_t dm_malloc_batch(size_t size, void **ptrs, size_t n);
+void dm_free_batch(void **ptrs, size_t n);
+int dm_txn_begin();
+void dm_txn_commit();
+void dm_txn_rollback();
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif // DMALLOC
 
@@ -0,0 +1,374 @@
+#if !defined(DMALLOC_HPP)
+#define DMALLOC_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "dm_alloc.h"
+#include "dm_arena.h"
+
+namespace dm
+{
+
+/**
+ * @brief monotonic arena for C++ objects.
+ *
+ * Objects come from bump chunks. Only types that are not trivially
+ * destructible get a destructor record, so plain structs cost nothing extra.
+ * reset() destroys everything newest first and keeps the memory for reuse.
+ */
+class arena
+{
+public:
+    explicit arena(std::size_t chunk_size = 4096)
+        : a_(dm_arena_create(chunk_size))
+    {
+        if (!a_)
+            throw std::bad_alloc();
+    }
+
+    ~arena() { dm_arena_destroy(a_); }
+
+    arena(const arena &) = delete;
+    arena &operator=(const arena &) = delete;
+
+    /**
+     * @brief raw memory that lives until reset
+     */
+    void *allocate(std::size_t size, std::size_t align = alignof(std::max_align_t))
+    {
+        void *p = dm_arena_alloc(a_, size, align);
+        if (!p)
+            throw std::bad_alloc();
+        return p;
+    }
+
+    /**
+     * @brief constructs a T in the arena, its destructor runs on reset
+     *
+     * The destructor is registered once the constructor returned, so an
+     * object whose constructor throws is never destroyed.
+     */
+    template <typename T, typename... Args>
+    T *make(Args &&...args)
+    {
+        if (std::is_trivially_destructible<T>::value)
+            return ::new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+
+        void *p = dm_arena_alloc_slot(a_, sizeof(T), alignof(T));
+        if (!p)
+            throw std::bad_alloc();
+        T *obj = ::new (p) T(std::forward<Args>(args)...);
+        dm_arena_set_dtor(a_, obj, &destroy<T>);
+        return obj;
+    }
+
+    void reset() { dm_arena_reset(a_); }
+
+private:
+    template <typename T>
+    static void destroy(void *obj) { static_cast<T *>(obj)->~T(); }
+
+    Arena *a_;
+};
+
+/**
+ * @brief std allocator over mmalloc, so std containers share the heap.
+ */
+template <typename T>
+struct allocator
+{
+    using value_type = T;
+
+    allocator() noexcept = default;
+    template <typename U>
+    allocator(const allocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n)
+    {
+        if (n > SIZE_MAX / sizeof(T))
+            throw std::bad_array_new_length();
+        void *p = mmalloc(n * sizeof(T));
+        if (!p)
+            throw std::bad_alloc();
+        return static_cast<T *>(p);
+    }
+
+    void deallocate(T *p, std::size_t) noexcept { mfree(p); }
+
+    template <typename U>
+    bool operator==(const allocator<U> &) const noexcept { return true; }
+    template <typename U>
+    bool operator!=(const allocator<U> &) const noexcept { return false; }
+};
+
+/**
+ * @brief growable array that uses the allocator's slack and in-place growth.
+ *
+ * Capacity is whatever dm_malloc_usable_size reports, so rounding slack is
+ * used before growing. Growth first tries dm_try_expand, then mrelloc for
+ * trivially copyable types, and only moves elements one by one otherwise.
+ */
+template <typename T>
+class vector
+{
+    static_assert(alignof(T) <= 8, "mmalloc aligns to 8 bytes, use dm_aligned_alloc for T");
+
+public:
+    vector() noexcept = default;
+
+    vector(vector &&other) noexcept
+        : data_(other.data_), size_(other.size_), cap_(other.cap_)
+    {
+        other.data_ = nullptr;
+        other.size_ = other.cap_ = 0;
+    }
+
+    vector &operator=(vector &&other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            data_ = other.data_;
+            size_ = other.size_;
+            cap_ = other.cap_;
+            other.data_ = nullptr;
+            other.size_ = other.cap_ = 0;
+        }
+        return *this;
+    }
+
+    vector(const vector &) = delete;
+    vector &operator=(const vector &) = delete;
+
+    ~vector() { release(); }
+
+    T *data() noexcept { return data_; }
+    const T *data() const noexcept { return data_; }
+    std::size_t size() const noexcept { return size_; }
+    std::size_t capacity() const noexcept { return cap_; }
+    bool empty() const noexcept { return size_ == 0; }
+
+    T &operator[](std::size_t i) noexcept { return data_[i]; }
+    const T &operator[](std::size_t i) const noexcept { return data_[i]; }
+    T &back() noexcept { return data_[size_ - 1]; }
+
+    T *begin() noexcept { return data_; }
+    T *end() noexcept { return data_ + size_; }
+    const T *begin() const noexcept { return data_; }
+    const T *end() const noexcept { return data_ + size_; }
+
+    void push_back(const T &value) { emplace_back(value); }
+    void push_back(T &&value) { emplace_back(std::move(value)); }
+
+    template <typename... Args>
+    T &emplace_back(Args &&...args)
+    {
+        if (size_ == cap_)
+        {
+            // `args` may refer to an element, build the value before the buffer moves
+            T value(std::forward<Args>(args)...);
+            reserve(cap_ ? cap_ * 2 : 4);
+            T *slot = ::new (data_ + size_) T(std::move(value));
+            size_++;
+            return *slot;
+        }
+        T *slot = ::new (data_ + size_) T(std::forward<Args>(args)...);
+        size_++;
+        return *slot;
+    }
+
+    /**
+     * @brief copies `n` elements from `src` to the end, `src` may point
+     * into this vector
+     */
+    void append(const T *src, std::size_t n)
+    {
+        if (size_ + n > cap_)
+        {
+            std::less<const T *> before;
+            bool inside = data_ && !before(src, data_) && before(src, data_ + size_);
+            std::size_t at = inside ? static_cast<std::size_t>(src - data_) : 0;
+            reserve(size_ + n > 2 * cap_ ? size_ + n : 2 * cap_);
+            if (inside)
+                src = data_ + at; // the elements moved with the buffer
+        }
+        if (std::is_trivially_copyable<T>::value)
+        {
+            if (n)
+                std::memcpy(static_cast<void *>(data_ + size_), src, n * sizeof(T));
+        }
+        else
+        {
+            for (std::size_t i = 0; i < n; i++)
+                ::new (data_ + size_ + i) T(src[i]);
+        }
+        size_ += n;
+    }
+
+    void pop_back() noexcept
+    {
+        data_[--size_].~T();
+    }
+
+    void clear() noexcept
+    {
+        while (size_)
+            pop_back();
+    }
+
+    void reserve(std::size_t n)
+    {
+        if (n <= cap_)
+            return;
+        if (n > SIZE_MAX / sizeof(T))
+            throw std::length_error("dm::vector::reserve");
+        std::size_t bytes = n * sizeof(T);
+
+        if (data_ && dm_try_expand(data_, bytes) == 0)
+        {
+            cap_ = dm_malloc_usable_size(data_) / sizeof(T);
+            return;
+        }
+
+        T *fresh;
+        if (std::is_trivially_copyable<T>::value)
+        {
+            fresh = static_cast<T *>(mrelloc(data_, bytes));
+            if (!fresh)
+                throw std::bad_alloc();
+        }
+        else
+        {
+            fresh = static_cast<T *>(mmalloc(bytes));
+            if (!fresh)
+                throw std::bad_alloc();
+            for (std::size_t i = 0; i < size_; i++)
+            {
+                ::new (fresh + i) T(std::move(data_[i]));
+                data_[i].~T();
+            }
+            mfree(data_);
+        }
+        data_ = fresh;
+        cap_ = dm_malloc_usable_size(data_) / sizeof(T);
+    }
+
+private:
+    void release() noexcept
+    {
+        clear();
+        mfree(data_);
+        data_ = nullptr;
+        cap_ = 0;
+    }
+
+    T *data_ = nullptr;
+    std::size_t size_ = 0;
+    std::size_t cap_ = 0;
+};
+
+/**
+ * @brief fixed size array with every element on its own cache lines.
+ *
+ * For per-thread counters and state: elements come from
+ * dm_alloc_padded_array, so no two of them, and no neighbouring heap
+ * block, ever share a DM_CACHE_LINE.
+ */
+template <typename T>
+class padded_array
+{
+    static_assert(alignof(T) <= DM_CACHE_LINE, "T is aligned beyond a cache line");
+
+public:
+    explicit padded_array(std::size_t n)
+        : stride_(dm_padded_stride(sizeof(T)))
+    {
+        if (n == 0)
+            return; // valid and empty, nothing to allocate
+        data_ = static_cast<char *>(dm_alloc_padded_array(n, sizeof(T)));
+        if (!data_)
+            throw std::bad_alloc();
+        try
+        {
+            for (; size_ < n; size_++)
+                ::new (data_ + size_ * stride_) T();
+        }
+        catch (...)
+        {
+            release();
+            throw;
+        }
+    }
+
+    padded_array(padded_array &&other) noexcept
+        : data_(other.data_), size_(other.size_), stride_(other.stride_)
+    {
+        other.data_ = nullptr;
+        other.size_ = 0;
+    }
+
+    padded_array(const padded_array &) = delete;
+    padded_array &operator=(const padded_array &) = delete;
+
+    ~padded_array() { release(); }
+
+    std::size_t size() const noexcept { return size_; }
+
+    T &operator[](std::size_t i) noexcept { return *reinterpret_cast<T *>(data_ + i * stride_); }
+    const T &operator[](std::size_t i) const noexcept { return *reinterpret_cast<const T *>(data_ + i * stride_); }
+
+private:
+    void release() noexcept
+    {
+        while (size_)
+            (*this)[--size_].~T();
+        mfree(data_);
+        data_ = nullptr;
+    }
+
+    char *data_ = nullptr;
+    std::size_t size_ = 0;
+    std::size_t stride_;
+};
+
+/**
+ * @brief byte string on dm::vector, always NUL terminated.
+ */
+class string
+{
+public:
+    string() = default;
+    string(const char *s) { append(s, std::strlen(s)); }
+
+    const char *c_str() const noexcept { return buf_.empty() ? "" : buf_.data(); }
+    const char *data() const noexcept { return c_str(); }
+    std::size_t size() const noexcept { return buf_.empty() ? 0 : buf_.size() - 1; }
+    std::size_t capacity() const noexcept { return buf_.capacity() ? buf_.capacity() - 1 : 0; }
+
+    char &operator[](std::size_t i) noexcept { return buf_[i]; }
+
+    string &append(const char *s, std::size_t n)
+    {
+        if (!buf_.empty())
+            buf_.pop_back(); // the NUL goes back on after the new bytes
+        buf_.append(s, n);
+        buf_.push_back('\0');
+        return *this;
+    }
+
+    string &operator+=(const char *s) { return append(s, std::strlen(s)); }
+    string &operator+=(char c) { return append(&c, 1); }
+
+private:
+    vector<char> buf_;
+};
+
+} // namespace dm
+
+#endif // DMALLOC_HPP
@@ -0,0 +1,60 @@
+#if !defined(DMARENA)
+#define DMARENA
+
+#include <stddef.h> // size_t
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * @brief a chunk of arena memory, payload follows the header.
+ * @param size usable bytes after the header.
+ * @param used bytes handed out so far.
+ * @param next previously filled chunk.
+ */
+typedef struct ArenaChunk
+{
+    size_t size;
+    size_t used;
+    struct ArenaChunk *next;
+} ArenaChunk;
+
+/**
+ * @brief destructor record stored in the arena right before its object.
+ * @param fn called with the object on reset.
+ * @param prev record registered before this one.
+ */
+typedef struct ArenaDtor
+{
+    void (*fn)(void *obj);
+    struct ArenaDtor *prev;
+} ArenaDtor;
+
+/**
+ * @brief bump allocator over chunks taken from mmalloc.
+ * @param chunks current chunk, older ones linked through `next`.
+ * @param dtors most recently registered destructor.
+ * @param chunk_size default payload size of a new chunk.
+ */
+typedef struct Arena
+{
+    ArenaChunk *chunks;
+    ArenaDtor *dtors;
+    size_t chunk_size;
+} Arena;
+
+Arena *dm_arena_create(size_t chunk_size);
+void *dm_arena_alloc(Arena *arena, size_t size, size_t align);
+void *dm_arena_alloc_dtor(Arena *arena, size_t size, size_t align, void (*fn)(void *));
+void *dm_arena_alloc_slot(Arena *arena, size_t size, size_t align);
+void dm_arena_set_dtor(Arena *arena, void *obj, void (*fn)(void *));
+void dm_arena_reset(Arena *arena);
+void dm_arena_destroy(Arena *arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DMARENA
@@ -0,0 +1,122 @@
+#if !defined(DMCOLD)
+#define DMCOLD
+
+#include <pthread.h>
+#include <stddef.h> // size_t
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** pages moved out together by one dm_cold_sweep step */
+#define DM_COLD_RUN 64
+
+/** page states, see ColdPage */
+#define DM_COLD_EMPTY 0    // never touched since create or reset
+#define DM_COLD_RESIDENT 1 // faulted in, may be compressed
+#define DM_COLD_PACKED 2   // released, compressed copy in `data`
+#define DM_COLD_ZERO 3     // released, held only zeros
+
+/**
+ * @brief one page of a cold arena.
+ * @param data compressed copy, mmalloc'd, while DM_COLD_PACKED.
+ * @param len bytes of `data`.
+ * @param touched sweep count when the page was last faulted in.
+ * @param state one of DM_COLD_EMPTY, RESIDENT, PACKED or ZERO.
+ */
+typedef struct ColdPage
+{
+    void *data;
+    uint32_t len;
+    uint32_t touched;
+    unsigned char state;
+} ColdPage;
+
+/**
+ * @brief what a cold arena saved and what it cost, see dm_cold_stats.
+ * @param resident_pages pages backed by memory.
+ * @param packed_pages pages released with a compressed copy.
+ * @param zero_pages pages released that held only zeros, no copy kept.
+ * @param packed_bytes bytes of all compressed copies.
+ * @param ratio page bytes per compressed byte over `packed_pages`.
+ * @param saved_bytes released page bytes minus `packed_bytes`.
+ * @param sweeps, compressions, incompressible calls of dm_cold_sweep,
+ * pages it released, pages it kept because they did not shrink enough.
+ * @param faults accesses that had to restore a released page.
+ * @param first_touches accesses to pages never touched before.
+ * @param faults_per_sec `faults` over the arena's lifetime.
+ * @param mean_fault_ns mean time to restore a page, seen by the handler.
+ */
+typedef struct ColdStats
+{
+    size_t resident_pages;
+    size_t packed_pages;
+    size_t zero_pages;
+    size_t packed_bytes;
+    double ratio;
+    size_t saved_bytes;
+    size_t sweeps;
+    size_t compressions;
+    size_t incompressible;
+    size_t faults;
+    size_t first_touches;
+    double faults_per_sec;
+    double mean_fault_ns;
+} ColdStats;
+
+/**
+ * @brief bump allocator whose idle pages are compressed in process.
+ * @param base, size the arena's address range, registered with userfaultfd.
+ * @param page system page size.
+ * @param used bytes handed out so far, from `base`.
+ * @param pages state of every page of the range.
+ * @param sweeps calls of dm_cold_sweep.
+ * @param uffd, wake userfaultfd and the pipe that stops the handler.
+ * @param scratch where a sweep moves pages to compress them.
+ * @param buffer page the handler decompresses into.
+ * @param packing compression output of a sweep.
+ * @param created_ns when the arena was created, for fault rates.
+ * @param fault_ns time the handler spent restoring released pages.
+ * @param lock guards everything above, taken by the handler for each fault.
+ */
+typedef struct ColdArena
+{
+    char *base;
+    size_t size;
+    size_t page;
+    size_t used;
+    ColdPage *pages;
+    uint32_t sweeps;
+    int uffd;
+    int wake[2];
+    pthread_t handler;
+    char *scratch;
+    char *buffer;
+    unsigned char *packing;
+    size_t resident_pages;
+    size_t packed_pages;
+    size_t zero_pages;
+    size_t packed_bytes;
+    size_t compressions;
+    size_t incompressible;
+    size_t faults;
+    size_t first_touches;
+    uint64_t created_ns;
+    uint64_t fault_ns;
+    pthread_mutex_t lock;
+} ColdArena;
+
+ColdArena *dm_cold_create(size_t size);
+void *dm_cold_alloc(ColdArena *arena, size_t size, size_t align);
+size_t dm_cold_sweep(ColdArena *arena, unsigned idle_sweeps);
+void dm_cold_stats(ColdArena *arena, ColdStats *out);
+void dm_cold_reset(ColdArena *arena);
+void dm_cold_destroy(ColdArena *arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DMCOLD
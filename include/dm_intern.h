@@ -0,0 +1,106 @@
+#if !defined(DMINTERN)
+#define DMINTERN
+
+#include <pthread.h>
+#include <stddef.h> // size_t
+#include <stdint.h> // uint32_t
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** independent locks, hash indexes and chunks; the low id bits pick one */
+#define DM_INTERN_SHARDS 16
+#define DM_INTERN_SHARD_BITS 4
+/** id segments per shard, segment k holds 256 << k ids */
+#define DM_INTERN_SEGMENTS 24
+
+/** dm_intern_create flag: count references, see dm_intern_release */
+#define DM_INTERN_REFCOUNT 1
+
+/**
+ * @brief header stored right before the bytes of an interned string.
+ * @param hash full hash of the bytes.
+ * @param len length without the terminating NUL.
+ * @param refs references in DM_INTERN_REFCOUNT pools.
+ * @param id handle returned by dm_intern.
+ */
+typedef struct InternEntry
+{
+    uint32_t hash;
+    uint32_t len;
+    uint32_t refs;
+    uint32_t id;
+} InternEntry;
+
+/**
+ * @brief bump chunk of entries, payload follows the header.
+ * @param prev, next neighbours in the shard's chunk list.
+ * @param size usable bytes after the header.
+ * @param used bytes handed out so far.
+ * @param live entries not released yet.
+ */
+typedef struct InternChunk
+{
+    struct InternChunk *prev;
+    struct InternChunk *next;
+    size_t size;
+    size_t used;
+    size_t live;
+} InternChunk;
+
+/**
+ * @brief one shard of a pool.
+ * @param index open addressing table of entries, NULL slots are empty.
+ * @param cap slots in `index`, a power of two.
+ * @param count entries in `index`, tombstones included.
+ * @param chunks current chunk first.
+ * @param segments id to entry, read without the lock.
+ * @param next_id ids handed out in this shard.
+ * @param free_ids released ids, linked through their segment slots.
+ */
+typedef struct InternShard
+{
+    pthread_mutex_t lock;
+    InternEntry **index;
+    size_t cap;
+    size_t count;
+    InternChunk *chunks;
+    InternEntry **segments[DM_INTERN_SEGMENTS];
+    uint32_t next_id;
+    uint32_t free_ids;
+} InternShard;
+
+/**
+ * @brief deduplicating store of immutable byte strings.
+ * @param chunk_size payload bytes per chunk.
+ * @param flags DM_INTERN_* given to dm_intern_create.
+ * @param strings distinct strings stored.
+ * @param bytes string bytes stored, NULs and headers excluded.
+ * @param hits dm_intern calls answered with an existing string.
+ */
+typedef struct InternPool
+{
+    size_t chunk_size;
+    int flags;
+    size_t strings;
+    size_t bytes;
+    size_t hits;
+    InternShard shards[DM_INTERN_SHARDS];
+} InternPool;
+
+InternPool *dm_intern_create(size_t chunk_size, int flags);
+const char *dm_intern(InternPool *pool, const void *bytes, size_t len, uint32_t *id);
+const char *dm_intern_str(InternPool *pool, uint32_t id);
+size_t dm_intern_len(const char *str);
+uint32_t dm_intern_id(const char *str);
+void dm_intern_release(InternPool *pool, uint32_t id);
+void dm_intern_clear(InternPool *pool);
+void dm_intern_destroy(InternPool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DMINTERN
@@ -0,0 +1,75 @@
+#if !defined(DMJIT)
+#define DMJIT
+
+#include <pthread.h>
+#include <stddef.h> // size_t
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** code size classes: 32, 64, ... 4096 bytes, larger code gets its own region */
+#define DM_JIT_CLASSES 8
+#define DM_JIT_MAX_CLASS 4096
+
+/** icache ranges queued before dm_jit_commit flushes on its own */
+#define DM_JIT_FLUSH_QUEUE 64
+
+/**
+ * @brief one memfd mapped twice: writable for the compiler, executable
+ * for callers. No page is ever writable and executable at one address.
+ * @param next next region of the heap.
+ * @param rw, rx the two views of the same pages.
+ * @param size bytes in each view.
+ * @param runs runs handed out so far, bumped from the start.
+ * @param run_class size class of each run, see JIT_RUN in dm_jit.c.
+ */
+typedef struct JitRegion
+{
+    struct JitRegion *next;
+    char *rw;
+    char *rx;
+    size_t size;
+    size_t runs;
+    unsigned char *run_class;
+} JitRegion;
+
+/**
+ * @brief executable code heap.
+ * @param region_size bytes per shared region.
+ * @param regions all regions, newest first.
+ * @param free_list free code blocks per size class, as rx addresses.
+ * @param flush_start, flush_end rx ranges waiting for an icache flush.
+ * @param pending number of queued ranges.
+ * @param inuse_bytes code bytes handed out, rounded to their class.
+ * @param mapped_bytes bytes of all regions.
+ * @param flushes calls of __builtin___clear_cache.
+ */
+typedef struct JitHeap
+{
+    size_t region_size;
+    JitRegion *regions;
+    void *free_list[DM_JIT_CLASSES];
+    char *flush_start[DM_JIT_FLUSH_QUEUE];
+    char *flush_end[DM_JIT_FLUSH_QUEUE];
+    size_t pending;
+    size_t inuse_bytes;
+    size_t mapped_bytes;
+    size_t flushes;
+    pthread_mutex_t lock;
+} JitHeap;
+
+JitHeap *dm_jit_create(size_t region_size);
+void *dm_jit_alloc(JitHeap *heap, size_t size, void **rw);
+void *dm_jit_writable(JitHeap *heap, void *code);
+void dm_jit_commit(JitHeap *heap, void *code, size_t len);
+void dm_jit_flush(JitHeap *heap);
+void dm_jit_free(JitHeap *heap, void *code);
+void dm_jit_destroy(JitHeap *heap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DMJIT
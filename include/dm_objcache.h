@@ -0,0 +1,81 @@
+#if !defined(DMOBJCACHE)
+#define DMOBJCACHE
+
+#include <pthread.h>
+#include <stddef.h> // size_t
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+struct ObjCache;
+
+/**
+ * @brief a run of equally sized objects carved from one mmalloc block.
+ * @param cache owning cache.
+ * @param prev, next neighbours in the cache's partial or full list.
+ * @param free_list free (still constructed) objects of this slab.
+ * @param inuse objects handed out.
+ *
+ * Every object is preceded by an ObjTag linking it back to its slab.
+ */
+typedef struct ObjSlab
+{
+    struct ObjCache *cache;
+    struct ObjSlab *prev;
+    struct ObjSlab *next;
+    void *free_list;
+    size_t inuse;
+} ObjSlab;
+
+/**
+ * @brief hidden word pair in front of each object, so freeing never
+ * writes into the constructed object itself.
+ */
+typedef struct ObjTag
+{
+    ObjSlab *slab;
+    void *next_free;
+} ObjTag;
+
+/**
+ * @brief cache of constructed objects of one type.
+ * @param size, align object layout.
+ * @param offset distance from a slot start to its object.
+ * @param stride bytes per slot, tag included.
+ * @param per_slab objects per slab.
+ * @param ctor run once when a slab is created, may be NULL.
+ * @param dtor run when a slab is reclaimed, may be NULL.
+ * @param partial slabs with free objects.
+ * @param full slabs without free objects.
+ * @param slabs number of slabs.
+ * @param inuse objects handed out.
+ */
+typedef struct ObjCache
+{
+    size_t size;
+    size_t align;
+    size_t offset;
+    size_t stride;
+    size_t per_slab;
+    void (*ctor)(void *obj);
+    void (*dtor)(void *obj);
+    ObjSlab *partial;
+    ObjSlab *full;
+    size_t slabs;
+    size_t inuse;
+    pthread_mutex_t lock;
+} ObjCache;
+
+ObjCache *dm_objcache_create(size_t size, size_t align, void (*ctor)(void *), void (*dtor)(void *));
+void *dm_objcache_alloc(ObjCache *cache);
+void dm_objcache_free(void *obj);
+size_t dm_objcache_reap(ObjCache *cache);
+void dm_objcache_destroy(ObjCache *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DMOBJCACHE
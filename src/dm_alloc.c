@@ -1,263 +1,3195 @@
+#define _GNU_SOURCE // PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP
 #include "dm_alloc.h"
+#include <pthread.h>
+#include <sys/mman.h> // madvise
+#include <stdlib.h> // getenv, strtoull
+#include <time.h>   // clock_gettime
+#include <fcntl.h>  // open
+#include <sys/syscall.h> // mbind, move_pages, futex
+#include <linux/futex.h>
+
+/*
+ * One lock guards the whole heap. It is recursive because public calls
+ * are built from each other (mrelloc uses mmalloc and mfree, trim uses
+ * purge, ...). There are no per-thread caches: a block freed by any
+ * thread, including one that has exited, is reusable by all others right
+ * away, so nothing is stranded when threads come and go.
+ */
+static pthread_mutex_t heap_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+#define LOCK() pthread_mutex_lock(&heap_lock)
+#define UNLOCK() pthread_mutex_unlock(&heap_lock)
 
 // the current head of mmalloc
 static BlockHeader *head = NULL;
+// the last block of the list, so append does not walk the heap
+static BlockHeader *tail = NULL;
 const size_t ALIGN = 8;
 
+// running allocator counters, see dm_get_stats
+static HeapStats stats;
+
+// tunables, see dm_configure
+static HeapConfig config = {DM_FIT_FIRST, 0, 0, 0, "", 0, 0, 0, 0, 0, 0};
+// set by dm_begin_shutdown, frees are skipped from then on
+static int shutting_down = 0;
+// whether DM_ALLOC_CONF has been applied
+static int config_loaded = 0;
+static int config_ready = 0; // set once DM_ALLOC_CONF is applied, read without the lock
+static void load_env_config();
+static void life_end(void *ptr, size_t size);
+static void unmap_block(BlockHeader *block);
+static BlockHeader *split_block(BlockHeader *block, size_t size);
+static BlockHeader *find_free(size_t size);
+static void coalesce();
+static int heap_try_expand(void *ptr, size_t size);
+static void cut_block(BlockHeader *block, size_t asize);
+static void start_profile();
+static void start_fast_exit();
+
+/*
+ * Copy-on-write mode (the `cow` option): in a forked child, headers below
+ * cow_limit were inherited from the parent and are never written, so
+ * their pages stay shared. Their free state lives in cow_set instead, an
+ * open addressing set of headers in child-private mmap memory.
+ */
+static char *cow_limit = NULL;
+static BlockHeader **cow_set = NULL;
+static size_t cow_cap = 0;   // slots, a power of two
+static size_t cow_slots = 0; // slots used, tombstones included
+#define COW_TOMB ((BlockHeader *)1)
+
+/*
+ * Lifetime profiler (the `lifetime` option): one allocation in N is
+ * sampled. Its birth time and callsite go into life_table, keyed by the
+ * payload pointer, and its age at free is added to the histograms of
+ * its size class and callsite. See dm_lifetime_dump.
+ */
+#define LIFE_SLOTS 65536 // sampled blocks alive at once, a power of two
+#define LIFE_SITES 1024  // distinct callsites, a power of two
+#define LIFE_BUCKETS 9   // <1us, <10us, ... <10s, >=10s
+#define LIFE_TOMB ((void *)1)
+
+typedef struct LifeSample
+{
+    void *ptr;
+    void *site;
+    uint64_t born_ns;
+} LifeSample;
+
+typedef struct LifeSite
+{
+    void *site;
+    size_t live;
+    size_t ages[LIFE_BUCKETS];
+} LifeSite;
+
+static LifeSample *life_table = NULL; // mmap'd on first use
+static LifeSample *life_spare = NULL; // same size, life_rehash moves samples here
+static LifeSite *life_sites = NULL;   // right after both tables
+static size_t life_live = 0;          // samples in life_table
+static size_t life_tombs = 0;         // LIFE_TOMB slots in life_table
+static size_t life_countdown = 0;     // allocations until the next sample
+static size_t life_dropped = 0;       // samples lost to a full table
+static size_t life_ages[DM_CLASSES][LIFE_BUCKETS];
+
+/*
+ * Class regions (the `classes` option): small blocks come from one
+ * reserved range cut into REGION_CLASSES spans of 2^REGION_SHIFT bytes.
+ * Span c holds blocks of exactly 16 << c bytes with no header, so the
+ * size of a block follows from its address alone. Pages are committed
+ * REGION_COMMIT bytes at a time as a span's bump pointer advances.
+ *
+ * Fresh blocks are carved with an atomic fetch-add on the bump pointer
+ * and need no lock; only reserving and committing take region_lock, and
+ * the free lists stay under the heap lock.
+ *
+ * In `cow` mode a forked child never links inherited blocks into a free
+ * list, that would write their pages. They go on a stack of its own in
+ * child-private memory instead, like cow_set for heap headers.
+ */
+#define REGION_CLASSES 12 // 16 bytes up to REGION_MAX
+#define REGION_MIN_SHIFT 4
+#define REGION_MAX ((size_t)1 << (REGION_MIN_SHIFT + REGION_CLASSES - 1))
+#if UINTPTR_MAX > 0xffffffffu
+#define REGION_SHIFT 30
+#else
+#define REGION_SHIFT 24
+#endif
+#define REGION_COMMIT 65536
+
+static pthread_mutex_t region_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *region_base = NULL;                // NULL until first use
+static int region_failed = 0;                   // reservation refused, use the heap
+static void *region_free_list[REGION_CLASSES];  // freed blocks, linked through their first word
+static size_t region_bumped[REGION_CLASSES];    // bytes handed out of each span
+static size_t region_committed[REGION_CLASSES]; // bytes readable and writable
+static size_t region_frozen[REGION_CLASSES];    // bytes of each span inherited in cow mode
+static void **region_cow_free[REGION_CLASSES];  // inherited blocks freed in this child
+static size_t region_cow_count[REGION_CLASSES];
+static size_t region_cow_cap[REGION_CLASSES];
+
+/*
+ * Mapped blocks (dm_malloc_numa) own an mmap of their own and never join
+ * the block list. Their header says BLOCK_MAPPED in `free` and sits at
+ * the end of a MAP_PREFIX byte prefix, which starts with a MapPrefix.
+ */
+#define BLOCK_MAPPED 2
+#define MAP_PREFIX 64
+#define NUMA_MAX_NODES 1024
+
+typedef struct MapPrefix
+{
+    size_t length; // bytes mapped, prefix included
+    int policy;    // DM_NUMA_* it was placed with
+} MapPrefix;
+
+static unsigned long numa_online[NUMA_MAX_NODES / (8 * sizeof(unsigned long))];
+
+/*
+ * Budget mode (the `budget` option): allocations that would take the
+ * bytes in use over config.budget fail, or wait in dm_malloc_wait. The
+ * waiters queue in FIFO order; only the head may allocate, and each
+ * sleeps on its own futex word until a free makes room for it.
+ */
+typedef struct BudgetWaiter
+{
+    size_t size;
+    uint32_t ready; // futex word, set when the waiter should look again
+    struct BudgetWaiter *next;
+} BudgetWaiter;
+
+static BudgetWaiter *waitq = NULL;      // head may allocate next
+static BudgetWaiter *waitq_tail = NULL;
+static int budget_admitted = 0;         // the head is allocating, skip the check
+
+// live and peak block counts per size class, see size_class
+static size_t class_live[DM_CLASSES];
+static size_t class_peak[DM_CLASSES];
+
+/*
+ * Allocation scopes: each thread logs the blocks it allocates while a
+ * scope is open in its own TxnLog. txn_owner maps every logged block to
+ * the log holding it, so a free on any thread takes the block out in
+ * O(1), and a rollback only frees the entries still owned by its log.
+ */
+#define DM_TXN_MAX_DEPTH 16
+#define TXN_TOMB ((void *)1)
+
+/**
+ * @brief allocation scopes opened by dm_txn_begin on this thread.
+ * @param blocks payloads allocated while a scope was open, mmap'd.
+ * @param cap entries `blocks` has room for.
+ * @param count number of used entries in `blocks`.
+ * @param marks `count` at the time each nested scope was opened.
+ * @param depth number of open scopes.
+ */
+typedef struct TxnLog
+{
+    void **blocks;
+    size_t cap;
+    size_t count;
+    size_t marks[DM_TXN_MAX_DEPTH];
+    int depth;
+} TxnLog;
+
+typedef struct TxnOwner
+{
+    void *ptr;   // NULL for an empty slot, TXN_TOMB for a removed one
+    TxnLog *log; // the thread's log holding it
+} TxnOwner;
+
+static _Thread_local TxnLog txn;
+static TxnOwner *txn_owner = NULL; // open addressing, under the heap lock
+static size_t txn_owner_cap = 0;   // slots, a power of two
+static size_t txn_owner_slots = 0; // slots used, tombstones included
+static size_t txn_owner_live = 0;  // blocks logged by all threads
+static pthread_key_t txn_key;      // runs txn_thread_exit
+static pthread_once_t txn_key_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Round up `size` to the closest factor of `align`
+ *
+ * @param size the number to round up
+ * @param align factor to round up
+ *
+ * @return rounded up size
+ */
+static inline size_t align_up(size_t size, size_t align)
+{
+
+    return (size + (align - 1)) & ~(align - 1);
+}
+
+/**
+ * @brief size class of a payload size: class k holds sizes up to 2^k.
+ */
+static inline int size_class(size_t size)
+{
+    int k = 3; // ALIGN is the smallest payload
+    while (k < DM_CLASSES - 1 && ((size_t)1 << k) < size)
+        k++;
+    return k;
+}
+
+/**
+ * @brief count a block of `size` bytes coming into use.
+ *
+ * Atomic, class region blocks are bumped without the heap lock.
+ */
+static inline void class_add(size_t size)
+{
+    int k = size_class(size);
+    size_t live = __atomic_add_fetch(&class_live[k], 1, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&class_peak[k], __ATOMIC_RELAXED);
+    while (live > peak &&
+           !__atomic_compare_exchange_n(&class_peak[k], &peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/**
+ * @brief count a block of `size` bytes going out of use.
+ */
+static inline void class_sub(size_t size)
+{
+    __atomic_fetch_sub(&class_live[size_class(size)], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief whether `block`'s header is shared with the parent process.
+ */
+static inline int frozen(BlockHeader *block)
+{
+    return (char *)block < cow_limit;
+}
+
+/**
+ * @brief home slot of `block` in a set of `cap` slots.
+ */
+static inline size_t cow_hash(BlockHeader *block, size_t cap)
+{
+    return (size_t)(((uintptr_t)block >> 3) * 0x9E3779B97F4A7C15ull >> 20) & (cap - 1);
+}
+
+/**
+ * @brief slot holding `block`, or cow_cap if it is not in the set.
+ */
+static size_t cow_find(BlockHeader *block)
+{
+    if (!cow_set)
+        return cow_cap;
+    for (size_t i = cow_hash(block, cow_cap);; i = (i + 1) & (cow_cap - 1))
+    {
+        if (cow_set[i] == block)
+            return i;
+        if (cow_set[i] == NULL)
+            return cow_cap;
+    }
+}
+
+/**
+ * @brief add `block` to the set, growing it as needed.
+ *
+ * @return 0 on success, -1 if no memory for a bigger set
+ */
+static int cow_insert(BlockHeader *block)
+{
+    if ((cow_slots + 1) * 2 > cow_cap)
+    {
+        size_t cap = cow_cap ? cow_cap * 2 : 4096;
+        BlockHeader **set = mmap(NULL, cap * sizeof(BlockHeader *), PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (set == MAP_FAILED)
+            return -1;
+        size_t live = 0;
+        for (size_t i = 0; i < cow_cap; i++)
+        {
+            BlockHeader *b = cow_set[i];
+            if (b == NULL || b == COW_TOMB)
+                continue;
+            size_t j = cow_hash(b, cap);
+            while (set[j])
+                j = (j + 1) & (cap - 1);
+            set[j] = b;
+            live++;
+        }
+        if (cow_set)
+            munmap(cow_set, cow_cap * sizeof(BlockHeader *));
+        cow_set = set;
+        cow_cap = cap;
+        cow_slots = live;
+    }
+
+    size_t i = cow_hash(block, cow_cap);
+    while (cow_set[i] && cow_set[i] != COW_TOMB)
+        i = (i + 1) & (cow_cap - 1);
+    if (cow_set[i] == NULL)
+        cow_slots++;
+    cow_set[i] = block;
+    return 0;
+}
+
+/**
+ * @brief whether `block` is free, looking at the side set for frozen ones.
+ */
+static inline int is_free(BlockHeader *block)
+{
+    if (frozen(block) && !block->free)
+        return cow_find(block) != cow_cap;
+    return block->free;
+}
+
+/**
+ * @brief first byte past the payload of `block`
+ */
+static inline char *block_end(BlockHeader *block)
+{
+    return (char *)(block + 1) + block->size;
+}
+
+/**
+ * @brief whether `next` starts right where `block` ends.
+ *
+ * sbrk is shared with the rest of the process (libc may move the break
+ * too), so neighbours in the list are not always neighbours in memory.
+ */
+static inline int adjacent(BlockHeader *block, BlockHeader *next)
+{
+    return block_end(block) == (char *)next;
+}
+
+/**
+ * @brief move the program break by `incr` bytes and keep the counters.
+ *
+ * @return the old break, or (void *)-1 if sbrk failed
+ */
+static void *heap_sbrk(intptr_t incr)
+{
+    void *old = sbrk(incr);
+    if (old == (void *)-1)
+        return old;
+    stats.sbrk_calls++;
+    if (incr > 0)
+        stats.mapped_bytes += incr;
+    stats.heap_bytes += incr;
+    if (stats.heap_bytes > stats.peak_heap_bytes)
+        stats.peak_heap_bytes = stats.heap_bytes;
+    return old;
+}
+
+/**
+ * @brief grow the free tail block in place so it can hold `size` bytes.
+ *
+ * When the last block is free and still ends at the program break, only
+ * the missing bytes are requested from sbrk instead of a whole new block,
+ * so the free memory at the top of the heap is used before the heap grows.
+ *
+ * @param size aligned payload size needed
+ *
+ * @return the grown tail block, or NULL if the tail cannot be extended
+ */
+static BlockHeader *extend_tail(size_t size)
+{
+    if (!tail || !tail->free || tail->size >= size || frozen(tail))
+        return NULL;
+    if (block_end(tail) != (char *)sbrk(0))
+        return NULL; // someone else moved the break after our tail
+
+    size_t missing = size - tail->size;
+    if (missing < config.grow)
+        missing = align_up(config.grow, ALIGN);
+    if (heap_sbrk(missing) == (void *)-1)
+        return NULL;
+
+    stats.reused_bytes += tail->size;
+    tail->size += missing;
+    return split_block(tail, size); // keeps any over-growth as the free tail
+}
+
+/**
+ * @brief Create a block and append it to the list
+ *
+ * @param mem_ptr current program break pointer
+ * @param size size of the block to allocate
+ *
+ * @returns pointer to the allocated block
+ */
+static BlockHeader *append(void *mem_ptr, size_t size)
+{
+    BlockHeader *block = (BlockHeader *)mem_ptr; /* tells complier to treat `mem_ptr` as the starting of `BlockHeader` and also tells that data will be stored in the structure of `BlockHeader` */
+    block->size = size;                          // payload size only
+    block->free = 0;
+    block->next = NULL;
+    stats.blocks++;
+    if (!head)
+    {
+        head = block;
+    }
+    else
+    {
+        tail->next = block;
+    }
+    tail = block;
+    return block;
+}
+
+/**
+ * @brief merge `block->next` into `block`, the two must be adjacent.
+ */
+static void absorb_next(BlockHeader *block)
+{
+    BlockHeader *next = block->next;
+    if (tail == next)
+        tail = block;
+    block->size += sizeof(BlockHeader) + next->size;
+    block->next = next->next;
+    stats.blocks--;
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief histogram bucket of an age: powers of ten from 1us up to 10s.
+ */
+static int life_bucket(uint64_t age_ns)
+{
+    int b = 0;
+    for (uint64_t limit = 1000; b < LIFE_BUCKETS - 1 && age_ns >= limit; limit *= 10)
+        b++;
+    return b;
+}
+
+/**
+ * @brief callsite record for `site`, NULL if the table is full.
+ */
+static LifeSite *life_site(void *site)
+{
+    size_t i = ((uintptr_t)site >> 2) & (LIFE_SITES - 1);
+    for (size_t n = 0; n < LIFE_SITES; n++, i = (i + 1) & (LIFE_SITES - 1))
+    {
+        if (life_sites[i].site == site)
+            return &life_sites[i];
+        if (life_sites[i].site == NULL)
+        {
+            life_sites[i].site = site;
+            return &life_sites[i];
+        }
+    }
+    return NULL;
+}
+
+static inline size_t life_hash(void *ptr)
+{
+    return (size_t)(((uintptr_t)ptr >> 3) * 0x9E3779B97F4A7C15ull >> 20) & (LIFE_SLOTS - 1);
+}
+
+/**
+ * @brief count an allocation and sample one in config.lifetime of them.
+ */
+static void life_begin(void *ptr, void *site)
+{
+    if (life_countdown > 1)
+    {
+        life_countdown--;
+        return;
+    }
+    life_countdown = config.lifetime;
+
+    if (!life_table)
+    {
+        size_t bytes = 2 * LIFE_SLOTS * sizeof(LifeSample) + LIFE_SITES * sizeof(LifeSite);
+        void *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            return;
+        life_table = mem;
+        life_spare = life_table + LIFE_SLOTS;
+        life_sites = (LifeSite *)(life_spare + LIFE_SLOTS);
+    }
+
+    LifeSite *rec = life_site(site);
+    if (!rec || life_live * 4 >= LIFE_SLOTS * 3)
+    {
+        life_dropped++;
+        return;
+    }
+    size_t i = life_hash(ptr);
+    while (life_table[i].ptr && life_table[i].ptr != LIFE_TOMB)
+        i = (i + 1) & (LIFE_SLOTS - 1);
+    if (life_table[i].ptr == LIFE_TOMB)
+        life_tombs--;
+    life_table[i] = (LifeSample){ptr, site, now_ns()};
+    rec->live++;
+    life_live++;
+}
+
+/**
+ * @brief move the live samples to the spare table, dropping tombstones.
+ *
+ * Runs once per LIFE_SLOTS / 4 tombstones, so its scan costs a few slots
+ * per sampled free.
+ */
+static void life_rehash()
+{
+    for (size_t i = 0; i < LIFE_SLOTS; i++)
+    {
+        void *ptr = life_table[i].ptr;
+        if (!ptr || ptr == LIFE_TOMB)
+            continue;
+        size_t j = life_hash(ptr);
+        while (life_spare[j].ptr)
+            j = (j + 1) & (LIFE_SLOTS - 1);
+        life_spare[j] = life_table[i];
+    }
+    LifeSample *old = life_table;
+    life_table = life_spare;
+    life_spare = old;
+    // dropped pages read back as zeros, no need to clear them by hand
+    madvise(old, LIFE_SLOTS * sizeof(LifeSample), MADV_DONTNEED);
+    life_tombs = 0;
+}
+
+/**
+ * @brief if `ptr` was sampled, add its age to the histograms.
+ */
+static void life_end(void *ptr, size_t size)
+{
+    size_t i = life_hash(ptr);
+    while (life_table[i].ptr != ptr)
+    {
+        if (life_table[i].ptr == NULL)
+            return; // not sampled
+        i = (i + 1) & (LIFE_SLOTS - 1);
+    }
+
+    int b = life_bucket(now_ns() - life_table[i].born_ns);
+    life_ages[size_class(size)][b]++;
+    LifeSite *rec = life_site(life_table[i].site);
+    rec->live--;
+    rec->ages[b]++;
+    life_table[i].ptr = LIFE_TOMB;
+    life_live--;
+    if (++life_tombs > LIFE_SLOTS / 4)
+        life_rehash();
+}
+
+/**
+ * @brief marks `block` free without coalescing.
+ */
+static void release(BlockHeader *block)
+{
+    if (life_live > 0)
+        life_end(block + 1, block->size);
+    if (frozen(block) && cow_insert(block) == 0)
+        stats.cow_deferred_frees++;
+    else
+        block->free = 1;
+    stats.in_use_bytes -= block->size;
+    stats.used_blocks--;
+    class_sub(block->size);
+}
+
+/**
+ * @brief marks `block` in use, the counterpart of release.
+ */
+static void claim(BlockHeader *block)
+{
+    if (block->free) // a frozen block is only claimed with its header already 0
+        block->free = 0;
+    stats.in_use_bytes += block->size;
+    stats.used_blocks++;
+    class_add(block->size);
+}
+
+/**
+ * @brief class region span holding `ptr`, -1 if it is not in one.
+ */
+static inline int region_class(const void *ptr)
+{
+    char *base = __atomic_load_n(&region_base, __ATOMIC_RELAXED);
+    uintptr_t off = (uintptr_t)ptr - (uintptr_t)base;
+    if (!base || off >= (uintptr_t)REGION_CLASSES << REGION_SHIFT)
+        return -1;
+    return (int)(off >> REGION_SHIFT);
+}
+
+static inline size_t region_size(int c)
+{
+    return (size_t)1 << (c + REGION_MIN_SHIFT);
+}
+
+/**
+ * @brief reserve the address range of all spans, once.
+ *
+ * The range starts on a span boundary, so every block is aligned to its
+ * size whatever alignment mmap would have given.
+ *
+ * @return the range, NULL if the system refused it
+ */
+static char *region_reserve()
+{
+    pthread_mutex_lock(&region_lock);
+    if (!region_base && !region_failed)
+    {
+        size_t span = (size_t)1 << REGION_SHIFT;
+        size_t bytes = (size_t)REGION_CLASSES << REGION_SHIFT;
+        char *raw = mmap(NULL, bytes + span, PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (raw == MAP_FAILED)
+            region_failed = 1;
+        else
+        {
+            char *base = (char *)align_up((uintptr_t)raw, span);
+            if (base > raw)
+                munmap(raw, (size_t)(base - raw));
+            if (base + bytes < raw + bytes + span)
+                munmap(base + bytes, (size_t)(raw + span - base));
+            __atomic_store_n(&region_base, base, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&region_lock);
+    return region_base;
+}
+
+/**
+ * @brief make the first `need` bytes of span `c` readable and writable.
+ *
+ * @return 0 on success, -1 if the span is full or mprotect failed
+ */
+static int region_commit(int c, size_t need)
+{
+    int rc = 0;
+    pthread_mutex_lock(&region_lock);
+    size_t have = region_committed[c];
+    if (have < need)
+    {
+        // another thread may have committed past `need` while we waited
+        size_t want = align_up(need, REGION_COMMIT);
+        char *span = region_base + ((size_t)c << REGION_SHIFT);
+        if (mprotect(span + have, want - have, PROT_READ | PROT_WRITE) == 0)
+        {
+            __atomic_fetch_add(&stats.map_calls, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&stats.region_bytes, want - have, __ATOMIC_RELAXED);
+            __atomic_store_n(&region_committed[c], want, __ATOMIC_RELEASE);
+        }
+        else
+            rc = -1;
+    }
+    pthread_mutex_unlock(&region_lock);
+    return rc;
+}
+
+/**
+ * @brief a block of at least `size` bytes from its class span.
+ *
+ * Blocks are aligned to their size. Callers need not hold the heap lock:
+ * a freed block is popped under it, a fresh one is bumped off the span
+ * without it.
+ *
+ * @return the block, NULL if the span is exhausted or not available
+ */
+static void *region_alloc(size_t size)
+{
+    char *base = __atomic_load_n(&region_base, __ATOMIC_ACQUIRE);
+    if (!base && !(base = region_reserve()))
+        return NULL;
+
+    int c = 0;
+    while (region_size(c) < size)
+        c++;
+    size_t bsize = region_size(c);
+    void *ptr = NULL;
+    if (__atomic_load_n(&region_free_list[c], __ATOMIC_RELAXED) ||
+        __atomic_load_n(&region_cow_count[c], __ATOMIC_RELAXED))
+    {
+        LOCK();
+        ptr = region_free_list[c];
+        if (ptr)
+            __atomic_store_n(&region_free_list[c], *(void **)ptr, __ATOMIC_RELAXED);
+        else if (region_cow_count[c])
+        {
+            size_t n = region_cow_count[c] - 1;
+            ptr = region_cow_free[c][n];
+            __atomic_store_n(&region_cow_count[c], n, __ATOMIC_RELAXED);
+        }
+        UNLOCK();
+    }
+    if (!ptr)
+    {
+        size_t off = __atomic_fetch_add(&region_bumped[c], bsize, __ATOMIC_RELAXED);
+        if (off + bsize > ((size_t)1 << REGION_SHIFT))
+            return NULL; // span exhausted, the heap takes over
+        if (off + bsize > __atomic_load_n(&region_committed[c], __ATOMIC_ACQUIRE) &&
+            region_commit(c, off + bsize) != 0)
+            return NULL;
+        ptr = base + ((size_t)c << REGION_SHIFT) + off;
+    }
+    __atomic_fetch_add(&stats.region_in_use_bytes, bsize, __ATOMIC_RELAXED);
+    class_add(bsize);
+    return ptr;
+}
+
+/**
+ * @brief keep an inherited block of class `c` on the child's side stack.
+ *
+ * @return 0 on success, -1 if the stack could not grow
+ */
+static int region_cow_push(int c, void *ptr)
+{
+    if (region_cow_count[c] == region_cow_cap[c])
+    {
+        size_t cap = region_cow_cap[c] ? region_cow_cap[c] * 2 : 512;
+        void **stack = mmap(NULL, cap * sizeof(void *), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (stack == MAP_FAILED)
+            return -1;
+        if (region_cow_free[c])
+        {
+            memcpy(stack, region_cow_free[c], region_cow_count[c] * sizeof(void *));
+            munmap(region_cow_free[c], region_cow_cap[c] * sizeof(void *));
+        }
+        region_cow_free[c] = stack;
+        region_cow_cap[c] = cap;
+    }
+    region_cow_free[c][region_cow_count[c]] = ptr;
+    __atomic_store_n(&region_cow_count[c], region_cow_count[c] + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * @brief put a class region block back on its free list.
+ *
+ * Addresses that are not the start of a block are ignored.
+ */
+static void region_free(void *ptr, int c)
+{
+    size_t bsize = region_size(c);
+    size_t off = (size_t)((char *)ptr - region_base) - ((size_t)c << REGION_SHIFT);
+    if (off & (bsize - 1))
+        return;
+    if (life_live > 0)
+        life_end(ptr, bsize);
+    if (off < region_frozen[c] && region_cow_push(c, ptr) == 0)
+        stats.cow_deferred_frees++;
+    else
+    {
+        *(void **)ptr = region_free_list[c];
+        __atomic_store_n(&region_free_list[c], ptr, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_sub(&stats.region_in_use_bytes, bsize, __ATOMIC_RELAXED);
+    class_sub(bsize);
+}
+
+/**
+ * @brief bytes counted against the budget: blocks in use of every kind.
+ */
+static inline size_t budget_used()
+{
+    return stats.in_use_bytes + __atomic_load_n(&stats.region_in_use_bytes, __ATOMIC_RELAXED) +
+           stats.mmap_bytes;
+}
+
+/**
+ * @brief whether `size` more bytes fit without delaying the first waiter.
+ */
+static int budget_admit(size_t size)
+{
+    size_t used = budget_used();
+    size_t ahead = waitq ? waitq->size : 0;
+    return used <= config.budget && size <= config.budget - used && ahead <= config.budget - used - size;
+}
+
+/**
+ * @brief whether the budget, or the room kept for the first waiter, is overrun.
+ *
+ * budget_admit sees the rounded request, but a free block too small to
+ * split is handed out whole, up to two headers and ALIGN bytes larger.
+ * Callers check this after such an allocation and give the block back.
+ */
+static int budget_overrun()
+{
+    size_t used = budget_used();
+    size_t ahead = waitq && !budget_admitted ? waitq->size : 0;
+    return used > config.budget || ahead > config.budget - used;
+}
+
+/**
+ * @brief bytes a heap or class block of `size` adds to budget_used.
+ *
+ * A class block counts its whole class, a heap block its ALIGN rounding.
+ */
+static size_t budget_charge(size_t size, size_t align)
+{
+    size_t need = size > align ? size : align;
+    if (config.classes && size && need <= REGION_MAX)
+    {
+        int c = 0;
+        while (region_size(c) < need)
+            c++;
+        return region_size(c);
+    }
+    return size > SIZE_MAX - ALIGN ? SIZE_MAX : align_up(size, ALIGN);
+}
+
+/**
+ * @brief wake the first waiter if its allocation fits now.
+ */
+static void budget_wake()
+{
+    if (!waitq || budget_used() > config.budget || waitq->size > config.budget - budget_used())
+        return;
+    __atomic_store_n(&waitq->ready, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &waitq->ready, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/**
+ * @brief release the block at payload `ptr`, wherever it lives.
+ */
+static void release_ptr(void *ptr)
+{
+    int c = region_class(ptr);
+    BlockHeader *block = (BlockHeader *)ptr - 1;
+    if (c >= 0)
+        region_free(ptr, c);
+    else if (block->free == BLOCK_MAPPED)
+        unmap_block(block);
+    else
+        release(block);
+    if (waitq)
+        budget_wake();
+}
+
+/**
+ * @brief update the counters after a block in use changed size in place.
+ */
+static void resized(BlockHeader *block, size_t old)
+{
+    stats.in_use_bytes += block->size;
+    stats.in_use_bytes -= old;
+    class_sub(old);
+    class_add(block->size);
+}
+
+static inline size_t txn_hash(void *ptr, size_t cap)
+{
+    return (size_t)(((uintptr_t)ptr >> 3) * 0x9E3779B97F4A7C15ull >> 20) & (cap - 1);
+}
+
+/**
+ * @brief slot of `ptr` in txn_owner, or txn_owner_cap if it is not logged.
+ */
+static size_t txn_owner_find(void *ptr)
+{
+    if (!txn_owner)
+        return txn_owner_cap;
+    for (size_t i = txn_hash(ptr, txn_owner_cap);; i = (i + 1) & (txn_owner_cap - 1))
+    {
+        if (txn_owner[i].ptr == ptr)
+            return i;
+        if (txn_owner[i].ptr == NULL)
+            return txn_owner_cap;
+    }
+}
+
+static void txn_owner_remove(size_t i)
+{
+    txn_owner[i].ptr = TXN_TOMB;
+    txn_owner_live--;
+}
+
+/**
+ * @brief map `ptr` to `log`, rebuilding the table when tombstones or
+ * entries fill half of it.
+ *
+ * @return 0 on success, -1 if no memory for the table
+ */
+static int txn_owner_insert(void *ptr, TxnLog *log)
+{
+    if ((txn_owner_slots + 1) * 2 > txn_owner_cap)
+    {
+        size_t cap = txn_owner_cap ? txn_owner_cap : 1024;
+        while ((txn_owner_live + 1) * 4 > cap)
+            cap *= 2;
+        TxnOwner *table = mmap(NULL, cap * sizeof(TxnOwner), PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (table == MAP_FAILED)
+            return -1;
+        for (size_t i = 0; i < txn_owner_cap; i++)
+        {
+            if (txn_owner[i].ptr == NULL || txn_owner[i].ptr == TXN_TOMB)
+                continue;
+            size_t j = txn_hash(txn_owner[i].ptr, cap);
+            while (table[j].ptr)
+                j = (j + 1) & (cap - 1);
+            table[j] = txn_owner[i];
+        }
+        if (txn_owner)
+            munmap(txn_owner, txn_owner_cap * sizeof(TxnOwner));
+        txn_owner = table;
+        txn_owner_cap = cap;
+        txn_owner_slots = txn_owner_live;
+    }
+
+    size_t i = txn_hash(ptr, txn_owner_cap);
+    while (txn_owner[i].ptr && txn_owner[i].ptr != TXN_TOMB)
+        i = (i + 1) & (txn_owner_cap - 1);
+    if (txn_owner[i].ptr == NULL)
+        txn_owner_slots++;
+    txn_owner[i] = (TxnOwner){ptr, log};
+    txn_owner_live++;
+    return 0;
+}
+
+/**
+ * @brief remember `ptr` in the innermost open scope.
+ *
+ * @return 0 on success, -1 if the log could not grow
+ */
+static int txn_record(void *ptr)
+{
+    if (txn.count == txn.cap)
+    {
+        size_t cap = txn.cap ? txn.cap * 2 : 1024;
+        void **blocks = mmap(NULL, cap * sizeof(void *), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (blocks == MAP_FAILED)
+            return -1;
+        if (txn.blocks)
+        {
+            memcpy(blocks, txn.blocks, txn.count * sizeof(void *));
+            munmap(txn.blocks, txn.cap * sizeof(void *));
+        }
+        txn.blocks = blocks;
+        txn.cap = cap;
+    }
+    if (txn_owner_insert(ptr, &txn) != 0)
+        return -1;
+    txn.blocks[txn.count++] = ptr;
+    return 0;
+}
+
+/**
+ * @brief forget `ptr` so a rollback does not free it a second time.
+ *
+ * Works for blocks logged by any thread, the heap lock must be held.
+ */
+static void txn_forget(void *ptr)
+{
+    size_t i = txn_owner_find(ptr);
+    if (i != txn_owner_cap)
+        txn_owner_remove(i);
+}
+
+/**
+ * @brief drop the entries of `log` from `mark` on, keeping their blocks.
+ */
+static void txn_drop_entries(TxnLog *log, size_t mark)
+{
+    for (size_t i = mark; i < log->count && txn_owner_live; i++)
+    {
+        size_t slot = txn_owner_find(log->blocks[i]);
+        if (slot != txn_owner_cap && txn_owner[slot].log == log)
+            txn_owner_remove(slot);
+    }
+    log->count = mark;
+}
+
+/**
+ * @brief a thread exits: its open scopes commit and its log goes away.
+ */
+static void txn_thread_exit(void *arg)
+{
+    TxnLog *log = arg;
+    LOCK();
+    txn_drop_entries(log, 0);
+    UNLOCK();
+    if (log->blocks)
+        munmap(log->blocks, log->cap * sizeof(void *));
+    log->blocks = NULL;
+    log->cap = 0;
+    log->depth = 0;
+}
+
+static void txn_make_key()
+{
+    pthread_key_create(&txn_key, txn_thread_exit);
+}
+
+/**
+ * @brief allocates `asize` aligned bytes at the top of the heap, never
+ * from the free list.
+ */
+static void *heap_grow(size_t asize)
+{
+    // reuse the free top of the heap before asking for a whole new block
+    BlockHeader *block = extend_tail(asize);
+    if (block)
+    {
+        claim(block);
+        return (block + 1);
+    }
+
+    // void *prev_brk = sbrk(0); // get current program break
+    size_t total_size = sizeof(BlockHeader) + asize;
+    if (total_size < config.grow)
+        total_size = align_up(config.grow, ALIGN); // the rest stays free at the top
+
+    void *mem_ptr = heap_sbrk(total_size); // ptr of the current program break and inc by total_size
+
+    if (mem_ptr == (void *)-1)
+        return NULL; // abrk failed
+
+    block = append(mem_ptr, total_size - sizeof(BlockHeader));
+    split_block(block, asize);
+    claim(block);
+
+    return (block + 1); /* skips header and returns the ptr to the payload*/
+}
+
+/**
+ * @brief allocates a block from the heap, see mmalloc.
+ */
+static void *heap_alloc(size_t size)
+{
+
+    if (size == 0)
+        return NULL;
+    if (!config_loaded)
+        load_env_config();
+
+    size_t asize = align_up(size, ALIGN); // aligned size
+
+    // check for free blocks
+
+    BlockHeader *block = find_free(asize);
+    if (!block && config.lazy_coalesce)
+    {
+        // frees skipped coalescing, merge now before growing the heap
+        coalesce();
+        block = find_free(asize);
+    }
+    if (block)
+    {
+        claim(block);
+        stats.reused_bytes += block->size;
+        return (block + 1);
+    }
+    return heap_grow(asize);
+}
+
+/**
+ * @brief allocates a block whose payload is a multiple of `align`.
+ *
+ * Over-allocates by `align` plus a header, then cuts the misaligned
+ * front off as a free block of its own, so mfree works as usual. The
+ * leftover behind the payload is cut off too unless the header is frozen;
+ * an inherited block that is not aligned already is not used at all, the
+ * block then comes from the top of the heap.
+ */
+static void *heap_aligned_alloc(size_t align, size_t size)
+{
+    size_t asize = align_up(size, ALIGN);
+    if (asize < size || asize > SIZE_MAX - align - 2 * sizeof(BlockHeader))
+        return NULL;
+    char *payload = heap_alloc(asize + align + sizeof(BlockHeader));
+    if (!payload || (uintptr_t)payload % align == 0)
+        return payload;
+
+    BlockHeader *front = (BlockHeader *)payload - 1;
+    if (frozen(front))
+    {
+        // cutting an inherited block would write shared headers, and any
+        // other free block may be inherited too: take fresh memory instead
+        release(front);
+        payload = heap_grow(asize + align + sizeof(BlockHeader));
+        if (!payload || (uintptr_t)payload % align == 0)
+            return payload;
+        front = (BlockHeader *)payload - 1;
+    }
+
+    // the front block needs room for a header and ALIGN bytes
+    char *aligned = (char *)align_up((uintptr_t)payload + sizeof(BlockHeader) + ALIGN, align);
+    BlockHeader *block = (BlockHeader *)aligned - 1;
+    size_t whole = front->size;
+
+    release(front);
+    block->size = whole - (size_t)(aligned - payload);
+    block->free = 0;
+    block->next = front->next;
+    front->size = (size_t)(aligned - payload) - sizeof(BlockHeader);
+    front->next = block;
+    if (tail == front)
+        tail = block;
+    stats.blocks++;
+
+    if (!frozen(block) && block->size > asize + 2 * sizeof(BlockHeader) + ALIGN)
+        cut_block(block, asize);
+    claim(block);
+    return aligned;
+}
+
+/**
+ * @brief allocates `block` of memory
+ * @param size size of the payload
+ * @param align payload alignment, a power of two
+ *
+ * @return ptr to the payload
+ */
+static void *tracked_alloc(size_t size, size_t align, void *site)
+{
+    if (!__atomic_load_n(&config_ready, __ATOMIC_ACQUIRE))
+    {
+        LOCK();
+        if (!config_loaded)
+            load_env_config();
+        UNLOCK();
+    }
+    void *ptr = NULL;
+    int small = __atomic_load_n(&config.classes, __ATOMIC_RELAXED) && size && size <= REGION_MAX &&
+                align <= REGION_MAX;
+    int budget = __atomic_load_n(&config.budget, __ATOMIC_RELAXED) != 0;
+    if (small && !budget)
+        ptr = region_alloc(size > align ? size : align);
+    // a bumped class block needs no lock unless it has to be recorded
+    if (ptr && !__atomic_load_n(&config.lifetime, __ATOMIC_RELAXED) && txn.depth == 0)
+        return ptr;
+
+    LOCK();
+    if (config.budget && !budget_admitted && !budget_admit(budget_charge(size, align)))
+    {
+        UNLOCK();
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (!ptr && small && budget)
+        ptr = region_alloc(size > align ? size : align);
+    if (!ptr)
+        ptr = align > ALIGN ? heap_aligned_alloc(align, size) : heap_alloc(size);
+    if (ptr && config.budget && budget_overrun())
+    {
+        // the block came whole and its real size does not fit
+        release_ptr(ptr);
+        coalesce();
+        UNLOCK();
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (ptr && config.lifetime)
+        life_begin(ptr, site);
+    if (ptr && txn.depth > 0 && txn_record(ptr) != 0)
+    {
+        // an untracked block would leak on rollback, fail instead
+        release_ptr(ptr);
+        coalesce();
+        errno = ENOMEM;
+        ptr = NULL;
+    }
+    UNLOCK();
+    return ptr;
+}
+
+void *mmalloc(size_t size)
+{
+    return tracked_alloc(size, ALIGN, __builtin_return_address(0));
+}
+
+static void budget_dequeue(BudgetWaiter *w)
+{
+    BudgetWaiter **link = &waitq, *prev = NULL;
+    while (*link != w)
+    {
+        prev = *link;
+        link = &(*link)->next;
+    }
+    *link = w->next;
+    if (waitq_tail == w)
+        waitq_tail = prev;
+}
+
+/**
+ * @brief mmalloc that waits for frees instead of failing over the budget.
+ *
+ * In budget mode (see dm_configure) an allocation that does not fit
+ * sleeps until enough memory is freed, for at most `timeout_ms`
+ * milliseconds (negative waits forever). Waiters are served in arrival
+ * order, and plain mmalloc calls only get through when they leave room
+ * for the first waiter, so a large request is not starved by small
+ * ones. Without a budget this is mmalloc.
+ *
+ * @return NULL with errno ETIMEDOUT on timeout, ENOMEM if `size` exceeds
+ * the whole budget or the heap is out of memory
+ */
+void *dm_malloc_wait(size_t size, long timeout_ms)
+{
+    void *site = __builtin_return_address(0);
+    LOCK();
+    if (!config_loaded)
+        load_env_config();
+    size_t charge = budget_charge(size, ALIGN);
+    size_t largest = charge + 2 * sizeof(BlockHeader) + ALIGN; // a block too small to split
+    BudgetWaiter w = {charge, 0, NULL};
+    if (!config.budget || (!waitq && budget_admit(charge)) || charge > config.budget || timeout_ms == 0)
+    {
+        void *ptr = tracked_alloc(size, ALIGN, site);
+        if (ptr || !config.budget || largest > config.budget || timeout_ms == 0)
+        {
+            UNLOCK();
+            return ptr;
+        }
+        w.size = largest; // the block found did not fit whole, wait for room
+    }
+
+    if (waitq_tail)
+        waitq_tail->next = &w;
+    else
+        waitq = &w;
+    waitq_tail = &w;
+    stats.budget_waits++;
+    uint64_t start = now_ns();
+    uint64_t limit = timeout_ms < 0 ? UINT64_MAX : start + (uint64_t)timeout_ms * 1000000u;
+
+    void *ptr;
+retry:
+    while (waitq != &w || budget_used() > config.budget || w.size > config.budget - budget_used())
+    {
+        uint64_t now = now_ns();
+        if (now >= limit)
+        {
+            budget_dequeue(&w);
+            budget_wake(); // the next in line may fit
+            stats.budget_timeouts++;
+            stats.budget_wait_ns += now - start;
+            UNLOCK();
+            errno = ETIMEDOUT;
+            return NULL;
+        }
+        w.ready = 0;
+        UNLOCK();
+        struct timespec rel, *timeout = NULL;
+        if (limit != UINT64_MAX)
+        {
+            rel.tv_sec = (time_t)((limit - now) / 1000000000u);
+            rel.tv_nsec = (long)((limit - now) % 1000000000u);
+            timeout = &rel;
+        }
+        syscall(SYS_futex, &w.ready, FUTEX_WAIT_PRIVATE, 0, timeout, NULL, 0);
+        LOCK();
+        if (!config.budget)
+            break; // budget switched off while waiting
+    }
+
+    budget_admitted = 1;
+    ptr = tracked_alloc(size, ALIGN, site);
+    budget_admitted = 0;
+    if (!ptr && config.budget && w.size < largest && largest <= config.budget)
+    {
+        // a block too small to split did not fit, wait for the largest one
+        w.size = largest;
+        goto retry;
+    }
+    budget_dequeue(&w);
+    uint64_t waited = now_ns() - start;
+    stats.budget_wait_ns += waited;
+    if (waited > stats.budget_max_wait_ns)
+        stats.budget_max_wait_ns = waited;
+    budget_wake();
+    UNLOCK();
+    return ptr;
+}
+
+/**
+ * @brief mmalloc with the payload aligned to `align`.
+ *
+ * Free with mfree. mrelloc keeps the alignment only while it resizes in
+ * place.
+ *
+ * @return NULL with errno EINVAL if `align` is not a power of two
+ */
+void *dm_aligned_alloc(size_t align, size_t size)
+{
+    if (align == 0 || (align & (align - 1)))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    return tracked_alloc(size, align, __builtin_return_address(0));
+}
+
+/**
+ * @brief distance between elements of a dm_alloc_padded_array.
+ */
+size_t dm_padded_stride(size_t elem_size)
+{
+    return elem_size ? align_up(elem_size, DM_CACHE_LINE) : DM_CACHE_LINE;
+}
+
+/**
+ * @brief zeroed array of `count` elements, each on its own cache lines.
+ *
+ * The array starts on a DM_CACHE_LINE boundary and element i lives at
+ * i * dm_padded_stride(elem_size), so per-thread slots never share a
+ * line with each other or with neighbouring heap blocks. Free with mfree.
+ */
+void *dm_alloc_padded_array(size_t count, size_t elem_size)
+{
+    size_t stride = dm_padded_stride(elem_size);
+    if (stride < elem_size || (count && stride > SIZE_MAX / count))
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *ptr = tracked_alloc(count * stride, DM_CACHE_LINE, __builtin_return_address(0));
+    if (ptr)
+        memset(ptr, 0, count * stride);
+    return ptr;
+}
+
+/**
+ * @brief number of NUMA nodes, from the `numa_nodes` option or sysfs.
+ *
+ * Fills numa_online with the nodes that can be used in a mask. Read on
+ * every call, the option can change and nodes can go offline, and it is
+ * cheap next to the mmap it comes with.
+ */
+static int numa_node_count()
+{
+    if (config.numa_nodes)
+    {
+        int n = config.numa_nodes < NUMA_MAX_NODES ? (int)config.numa_nodes : NUMA_MAX_NODES;
+        memset(numa_online, 0, sizeof(numa_online));
+        for (int i = 0; i < n; i++)
+            numa_online[i / (8 * sizeof(unsigned long))] |= 1ul << (i % (8 * sizeof(unsigned long)));
+        return n;
+    }
+    // a list such as "0-3,6", a single node when it cannot be read
+    char buf[256] = "0";
+    int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        ssize_t n = read(fd, buf, sizeof(buf) - 1);
+        buf[n > 0 ? n : 0] = '\0';
+        close(fd);
+    }
+    int nodes = 0;
+    memset(numa_online, 0, sizeof(numa_online));
+    for (char *p = buf; *p >= '0' && *p <= '9';)
+    {
+        long lo = strtol(p, &p, 10), hi = lo;
+        if (*p == '-')
+            hi = strtol(p + 1, &p, 10);
+        for (long i = lo; i <= hi && i < NUMA_MAX_NODES; i++)
+        {
+            numa_online[i / (8 * sizeof(unsigned long))] |= 1ul << (i % (8 * sizeof(unsigned long)));
+            if (i >= nodes)
+                nodes = (int)i + 1;
+        }
+        if (*p == ',')
+            p++;
+    }
+    return nodes ? nodes : 1;
+}
+
+static inline int numa_is_online(int node)
+{
+    return (numa_online[node / (8 * sizeof(unsigned long))] >> (node % (8 * sizeof(unsigned long)))) & 1;
+}
+
+/**
+ * @brief set the memory policy of a fresh mapping before it is touched.
+ *
+ * @return 0 on success, -1 with errno set by mbind
+ */
+static int numa_bind(void *mem, size_t len, int policy)
+{
+    enum
+    {
+        MPOL_PREFERRED_ = 1,
+        MPOL_BIND_ = 2,
+        MPOL_INTERLEAVE_ = 3
+    };
+    unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+    int mode = MPOL_PREFERRED_; // with an empty mask: the faulting CPU's node
+    if (policy == DM_NUMA_INTERLEAVE)
+    {
+        memcpy(mask, numa_online, sizeof(mask));
+        mode = MPOL_INTERLEAVE_;
+    }
+    else if (policy >= 0)
+    {
+        mask[policy / (8 * sizeof(unsigned long))] = 1ul << (policy % (8 * sizeof(unsigned long)));
+        mode = MPOL_BIND_;
+    }
+    if (syscall(SYS_mbind, mem, len, mode, mask, NUMA_MAX_NODES + 1, 0) == 0)
+        return 0;
+    return errno == ENOSYS ? 0 : -1; // a kernel without NUMA has one node anyway
+}
+
+/**
+ * @brief a block with its own mapping, placed by `policy`.
+ */
+static void *map_block(size_t size, int policy)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    int nodes = numa_node_count();
+    if (size == 0 || policy < DM_NUMA_INTERLEAVE || policy >= nodes ||
+        (policy >= 0 && !numa_is_online(policy)))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (size > SIZE_MAX - MAP_PREFIX - page)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t len = align_up(size + MAP_PREFIX, page);
+    char *mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return NULL;
+    // a fake topology (numa_nodes option) only changes dm_numa_residency
+    if (!config.numa_nodes && numa_bind(mem, len, policy) != 0)
+    {
+        int err = errno;
+        munmap(mem, len);
+        errno = err;
+        return NULL;
+    }
+
+    MapPrefix *prefix = (MapPrefix *)mem;
+    prefix->length = len;
+    prefix->policy = policy;
+    BlockHeader *block = (BlockHeader *)(mem + MAP_PREFIX) - 1;
+    block->size = len - MAP_PREFIX;
+    block->free = BLOCK_MAPPED;
+    block->next = NULL;
+    stats.map_calls++;
+    stats.mmap_blocks++;
+    stats.mmap_bytes += len;
+    if (stats.mmap_blocks > stats.mmap_peak_blocks)
+        stats.mmap_peak_blocks = stats.mmap_blocks;
+    if (stats.mmap_bytes > stats.mmap_peak_bytes)
+        stats.mmap_peak_bytes = stats.mmap_bytes;
+    return block + 1;
+}
+
+static void unmap_block(BlockHeader *block)
+{
+    MapPrefix *prefix = (MapPrefix *)((char *)(block + 1) - MAP_PREFIX);
+    if (life_live > 0)
+        life_end(block + 1, block->size);
+    stats.map_calls++;
+    stats.mmap_blocks--;
+    stats.mmap_bytes -= prefix->length;
+    munmap(prefix, prefix->length);
+}
+
+/**
+ * @brief map_block with the bookkeeping of tracked_alloc: the budget,
+ * lifetime sampling and the open allocation scope.
+ */
+static void *tracked_map(size_t size, int policy, void *site)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t charge = size > SIZE_MAX - MAP_PREFIX - page ? SIZE_MAX : align_up(size + MAP_PREFIX, page);
+    if (config.budget && !budget_admitted && !budget_admit(charge))
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *ptr = map_block(size, policy);
+    if (ptr && config.lifetime)
+        life_begin(ptr, site);
+    if (ptr && txn.depth > 0 && txn_record(ptr) != 0)
+    {
+        unmap_block((BlockHeader *)ptr - 1);
+        errno = ENOMEM;
+        ptr = NULL;
+    }
+    return ptr;
+}
+
+/**
+ * @brief allocate `size` bytes on their own mapping with a NUMA placement.
+ *
+ * `policy` is DM_NUMA_LOCAL (pages land on the node of the thread that
+ * first touches them), DM_NUMA_INTERLEAVE (pages round robin over all
+ * nodes, for tables every thread scans) or DM_NUMA_NODE(n). Meant for
+ * large buffers: the size is rounded up to whole pages. Free with mfree;
+ * mrelloc keeps the policy.
+ *
+ * @return NULL with errno EINVAL for an unknown node, or as set by mbind
+ */
+void *dm_malloc_numa(size_t size, int policy)
+{
+    LOCK();
+    if (!config_loaded)
+        load_env_config();
+    void *ptr = tracked_map(size, policy, __builtin_return_address(0));
+    UNLOCK();
+    return ptr;
+}
+
+/**
+ * @brief count the resident pages of a dm_malloc_numa block per node.
+ *
+ * `per_node[n]` gets the pages on node n, for n < `max_nodes`. Pages not
+ * touched yet are not counted. With the `numa_nodes` option the nodes
+ * are where the policy would have put each page, so placement logic can
+ * be tested on a single node machine.
+ *
+ * @return resident pages, or -1 with errno EINVAL if `ptr` is not a
+ * dm_malloc_numa block
+ */
+long dm_numa_residency(void *ptr, size_t *per_node, int max_nodes)
+{
+    if (!ptr || region_class(ptr) >= 0 || ((BlockHeader *)ptr - 1)->free != BLOCK_MAPPED)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    MapPrefix *prefix = (MapPrefix *)((char *)ptr - MAP_PREFIX);
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t pages = prefix->length / page;
+    int fake = config.numa_nodes != 0;
+    int nodes = numa_node_count();
+    long resident = 0;
+    memset(per_node, 0, (size_t)max_nodes * sizeof(size_t));
+
+    enum
+    {
+        BATCH = 256
+    };
+    void *addrs[BATCH];
+    int status[BATCH];
+    unsigned char vec[BATCH];
+    for (size_t first = 0; first < pages; first += BATCH)
+    {
+        size_t n = pages - first < BATCH ? pages - first : BATCH;
+        char *start = (char *)prefix + first * page;
+        if (mincore(start, n * page, vec) != 0)
+            return -1;
+        for (size_t i = 0; i < n; i++)
+        {
+            addrs[i] = start + i * page;
+            status[i] = 0;
+        }
+        // move_pages with no target nodes only reports where pages are
+        if (!fake && syscall(SYS_move_pages, 0, n, addrs, NULL, status, 0) != 0 && errno != ENOSYS)
+            return -1;
+
+        for (size_t i = 0; i < n; i++)
+        {
+            if (!(vec[i] & 1))
+                continue;
+            int node = status[i];
+            if (fake)
+            {
+                if (prefix->policy == DM_NUMA_INTERLEAVE)
+                    node = (int)((first + i) % (size_t)nodes);
+                else
+                    node = prefix->policy >= 0 ? prefix->policy : 0;
+            }
+            if (node < 0)
+                continue; // not present after all
+            resident++;
+            if (node < max_nodes)
+                per_node[node]++;
+        }
+    }
+    return resident;
+}
+
+void *mcalloc(size_t num, size_t size)
+{
+    size_t total_size = num * size;
+    void *ptr = tracked_alloc(total_size, ALIGN, __builtin_return_address(0));
+    if (ptr == NULL)
+    {
+        return NULL; // malloc failed
+    }
+    // Set all bytes in the allocated block to 0
+    memset(ptr, 0, total_size);
+    return ptr;
+}
+
+static void *heap_realloc(void *ptr, size_t size, void *site)
+{
+    if (ptr == NULL)
+    {
+        // realloc(NULL, size) is equivalent to malloc(size)
+        return tracked_alloc(size, ALIGN, site);
+    }
+    if (size == 0)
+    {
+        // realloc(ptr, 0) is equivalent to free(ptr)
+        mfree(ptr);
+        return NULL;
+    }
+
+    int c = region_class(ptr);
+    if (c >= 0)
+    {
+        if (size <= region_size(c))
+            return ptr;
+        void *new_ptr = tracked_alloc(size, ALIGN, site);
+        if (!new_ptr)
+            return NULL;
+        memcpy(new_ptr, ptr, region_size(c));
+        mfree(ptr);
+        return new_ptr;
+    }
+
+    BlockHeader *header = (BlockHeader *)ptr - 1;
+
+    if (header->free == BLOCK_MAPPED)
+    {
+        if (size <= header->size)
+            return ptr;
+        MapPrefix *prefix = (MapPrefix *)((char *)ptr - MAP_PREFIX);
+        void *new_ptr = tracked_map(size, prefix->policy, site);
+        if (!new_ptr)
+            return NULL;
+        memcpy(new_ptr, ptr, header->size);
+        mfree(ptr);
+        return new_ptr;
+    }
+    if (header->size >= size && frozen(header))
+        return ptr; // splitting would write the shared header
+    if (header->size >= size)
+    {
+        // shrink in place, a cut off tail may join a free neighbour
+        BlockHeader *next = header->next;
+        size_t old = header->size;
+        split_block(header, size);
+        resized(header, old);
+        BlockHeader *rest = header->next;
+        if (rest != next && next && next->free && adjacent(rest, next))
+            absorb_next(rest);
+        if (waitq)
+            budget_wake(); // the cut off tail may be what a waiter needs
+        return ptr;
+    }
+
+    if (heap_try_expand(ptr, size) == 0)
+        return ptr;
+
+    void *new_ptr = tracked_alloc(size, ALIGN, site);
+    if (!new_ptr)
+        return NULL; // the old block stays valid, like realloc
+    memcpy(new_ptr, ptr, header->size);
+    mfree(ptr);
+    return new_ptr;
+}
+
+void *mrelloc(void *ptr, size_t size)
+{
+    LOCK();
+    void *p = heap_realloc(ptr, size, __builtin_return_address(0));
+    UNLOCK();
+    return p;
+}
+
+/**
+ * @brief payload bytes usable at `ptr`, at least what was requested.
+ */
+size_t dm_malloc_usable_size(void *ptr)
+{
+    if (!ptr)
+        return 0;
+    int c = region_class(ptr);
+    if (c >= 0)
+        return region_size(c);
+    return ((BlockHeader *)ptr - 1)->size;
+}
+
+/**
+ * @brief grow the block at `ptr` to `size` bytes without moving it.
+ *
+ * Takes over the following free block, or grows the heap if the block is
+ * the last one. Nothing changes when neither is possible.
+ *
+ * @return 0 if the block now holds `size` bytes, -1 otherwise
+ */
+static int heap_try_expand(void *ptr, size_t size)
+{
+    if (!ptr)
+        return -1;
+    int c = region_class(ptr);
+    if (c >= 0)
+        return size <= region_size(c) ? 0 : -1;
+    BlockHeader *block = (BlockHeader *)ptr - 1;
+    size_t asize = align_up(size, ALIGN);
+    if (block->size >= asize)
+        return 0;
+    if (block->free == BLOCK_MAPPED || frozen(block))
+        return -1;
+
+    BlockHeader *next = block->next;
+    if (next && next->free && adjacent(block, next) &&
+        block->size + sizeof(BlockHeader) + next->size >= asize)
+    {
+        // split_block keeps a rest too small to be a block, that is charged too
+        size_t whole = block->size + sizeof(BlockHeader) + next->size;
+        size_t grown = whole <= asize + 2 * sizeof(BlockHeader) + ALIGN ? whole : asize;
+        if (config.budget && !budget_admitted && !budget_admit(grown - block->size))
+            return -1;
+        size_t old = block->size;
+        stats.reused_bytes += sizeof(BlockHeader) + next->size;
+        absorb_next(block);
+        split_block(block, asize);
+        resized(block, old);
+        return 0;
+    }
+
+    if (block == tail && block_end(block) == (char *)sbrk(0))
+    {
+        size_t old = block->size;
+        if (config.budget && !budget_admitted && !budget_admit(asize - old))
+            return -1;
+        if (heap_sbrk(asize - old) == (void *)-1)
+            return -1;
+        block->size = asize;
+        resized(block, old);
+        return 0;
+    }
+    return -1;
+}
+
+int dm_try_expand(void *ptr, size_t size)
+{
+    LOCK();
+    int rc = heap_try_expand(ptr, size);
+    UNLOCK();
+    return rc;
+}
+
+/**
+ * @brief splits large free blocks for new allocations , if feastable
+ *
+ * @param block the free block for splitting
+ * @param size size of the payload
+ *
+ * @return `block` for allocating data
+ */
+static BlockHeader *split_block(BlockHeader *block, size_t size)
+{
+    size_t asize = align_up(size, ALIGN);
+    // the min block size is sizeof(BlockHeader) + ALIGN, if leftover <= no use of splitting
+    if (block->size <= asize + 2 * sizeof(BlockHeader) + ALIGN)
+    {
+        // not enough to split, use whole block
+        // free the block and use it
+        block->free = 0;
+        return block;
+    }
+    // if its splittable
+    cut_block(block, asize);
+    block->free = 0;
+    return block; // the allocated part
+}
+
+/**
+ * @brief split `block` after `asize` payload bytes, unconditionally.
+ *
+ * The caller makes sure the rest can hold a header and ALIGN bytes.
+ * The new block after `block` is free.
+ */
+static void cut_block(BlockHeader *block, size_t asize)
+{
+    // create new Blockheader at leftover location
+    // size : required size for the block
+    size_t leftover = block->size - asize - sizeof(BlockHeader);
+
+    /* move new_block to skip current `block` header and asize(needed to store data)*/
+    BlockHeader *new_block = (BlockHeader *)((char *)(block + 1) + asize);
+
+    new_block->size = leftover;
+    new_block->free = 1;
+    new_block->next = block->next;
+
+    // update original block
+    block->size = asize;
+    block->next = new_block;
+    if (tail == block)
+        tail = new_block;
+    stats.blocks++;
+}
+
+/**
+ * @brief reuse a frozen block freed in this child, whole and unsplit.
+ *
+ * Blocks that were free at fork are left alone, claiming them would
+ * write their header.
+ *
+ * @return 1 if `block` was taken out of the side set
+ */
+static int take_frozen(BlockHeader *block, size_t size)
+{
+    if (block->free || block->size < size || block->size > 2 * size + sizeof(BlockHeader))
+        return 0;
+    size_t i = cow_find(block);
+    if (i == cow_cap)
+        return 0;
+    cow_set[i] = COW_TOMB;
+    return 1;
+}
+
+/**
+ * @brief like find_free, but takes the smallest free block that fits.
+ */
+static BlockHeader *find_best(size_t size)
+{
+    BlockHeader *best = NULL;
+    for (BlockHeader *curr = head; curr; curr = curr->next)
+    {
+        if (frozen(curr))
+        {
+            if (take_frozen(curr, size))
+                return curr;
+            continue;
+        }
+        if (!curr->free || curr->size < size)
+            continue;
+        if (curr->size == size)
+            return curr; // perfect fit
+        if (!best || curr->size < best->size)
+            best = curr;
+    }
+    if (best)
+        return split_block(best, size);
+    return NULL;
+}
+
+/**
+ * @brief finds a free block from the pre-allocated blocks.
+ * @param size size of the block needed
+ *
+ * @return ptr of the free block on success, else NULL
+ */
+static BlockHeader *find_free(size_t size)
+{
+    if (config.fit == DM_FIT_BEST)
+        return find_best(size);
+
+    BlockHeader *curr = head;
+    while (curr != NULL)
+    {
+        if (frozen(curr))
+        {
+            if (take_frozen(curr, size))
+                return curr;
+        }
+        else if (curr->free)
+        {
+            if (curr->size == size)
+            {
+                return curr; // perfect fit
+            }
+            if (curr->size >= size + sizeof(BlockHeader) + ALIGN)
+            {
+                return split_block(curr, size); // split
+            }
+            if (curr->size >= size)
+            {
+                // block is a bit bigger, but not enough to split
+                return curr;
+            }
+        }
+
+        curr = curr->next;
+    }
+    return NULL;
+}
+
+/**
+ * @brief join free blocks
+ */
+static void coalesce()
+{
+    BlockHeader *curr = head;
+
+    while (curr && curr->next)
+    {
+        if (curr->free && curr->next->free && !frozen(curr) && adjacent(curr, curr->next))
+        {
+            // merge curr with next
+            absorb_next(curr);
+            // do not move curr forward — there might be more consecutive free blocks
+        }
+        else
+        {
+            curr = curr->next;
+        }
+    }
+}
+
+/**
+ * @brief lower the break so that the free tail keeps only `pad` bytes.
+ *
+ * Whole pages only, and only when no one else moved the break since.
+ *
+ * @return 1 if memory was given back, else 0
+ */
+static int trim_top(size_t pad)
+{
+    if (!tail || !tail->free || frozen(tail) || block_end(tail) != (char *)sbrk(0))
+        return 0;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t keep = pad < ALIGN ? ALIGN : align_up(pad, ALIGN);
+    if (tail->size <= keep)
+        return 0;
+    size_t cut = (tail->size - keep) & ~(page - 1);
+    if (cut == 0 || heap_sbrk(-(intptr_t)cut) == (void *)-1)
+        return 0;
+    tail->size -= cut;
+    stats.trimmed_bytes += cut;
+    return 1;
+}
+
+/**
+ * @brief mark the block at `ptr` free, without coalescing.
+ */
+static void drop(void *ptr)
+{
+    if (!ptr)
+        return;
+    if (shutting_down)
+    {
+        // the OS takes the whole heap back at exit
+        stats.skipped_frees++;
+        return;
+    }
+    /*
+    as in mmalloc, block -1 moves our ptr to
+    say 16 bytes backwards to the start of our
+    header.
+    */
+    release_ptr(ptr);
+    if (txn_owner_live)
+        txn_forget(ptr);
+
+    // not so performance friendly
+    // memset(ptr, 0, block->size); // write the content t0 0
+}
+
+/**
+ * @brief coalesce and trim after blocks were dropped.
+ */
+static void settle()
+{
+    // coalescing, lazy mode leaves it to the next allocation miss
+    if (!config.lazy_coalesce && !shutting_down)
+    {
+        coalesce();
+        if (config.trim && tail && tail->free && tail->size > config.trim)
+            trim_top(config.grow);
+    }
+}
+
+static void heap_free(void *ptr)
+{
+    if (!ptr)
+        return;
+    drop(ptr);
+    settle();
+}
+
+/**
+ * @brief free allocated blocks
+ *
+ * @param ptr block pointer
+ */
+void mfree(void *ptr)
+{
+    LOCK();
+    heap_free(ptr);
+    UNLOCK();
+}
+
+/**
+ * @brief allocate up to `n` blocks of `size` bytes as one unit.
+ *
+ * The blocks are carved from a single free region, found or grown once,
+ * under one lock acquisition. Use it to refill a per-thread stash of
+ * objects instead of calling mmalloc `n` times. In budget mode the
+ * carve is only taken if all `n` blocks fit, otherwise the blocks are
+ * allocated one at a time as mmalloc would.
+ *
+ * @param ptrs receives the payload pointers
+ *
+ * @return number of blocks allocated, less than `n` only if out of memory
+ */
+size_t dm_malloc_batch(size_t size, void **ptrs, size_t n)
+{
+    if (size == 0 || n == 0)
+        return 0;
+    if (size > SIZE_MAX - ALIGN)
+        return 0;
+    size_t asize = align_up(size, ALIGN);
+    size_t got = 0, carved = 0;
+    void *site = __builtin_return_address(0);
+
+    LOCK();
+    if (!config_loaded)
+        load_env_config();
+    // the whole carve is admitted at once, otherwise blocks go one by one
+    int fits = n <= (SIZE_MAX - sizeof(BlockHeader)) / (sizeof(BlockHeader) + asize) &&
+               (!config.budget || budget_admitted || budget_admit(n * asize));
+    void *region = n > 1 && fits ? heap_alloc(n * (sizeof(BlockHeader) + asize) - sizeof(BlockHeader)) : NULL;
+    if (region && frozen((BlockHeader *)region - 1))
+    {
+        // an inherited block is never cut, its headers are shared
+        release((BlockHeader *)region - 1);
+        region = NULL;
+    }
+    if (region)
+    {
+        BlockHeader *block = (BlockHeader *)region - 1;
+        release(block); // claimed again piece by piece
+        while (got < n)
+        {
+            if (got < n - 1)
+                cut_block(block, asize);
+            claim(block);
+            ptrs[got++] = block + 1;
+            block = block->next;
+        }
+        if (config.budget && budget_overrun())
+        {
+            // the region came whole, its last block took the rest and does not fit
+            drop(ptrs[--got]);
+            settle();
+        }
+        carved = got;
+    }
+    for (; got < n; got++)
+    {
+        ptrs[got] = tracked_alloc(size, ALIGN, site); // admitted and recorded there
+        if (!ptrs[got])
+            break;
+    }
+
+    if (txn.depth > 0)
+    {
+        for (size_t i = 0; i < carved; i++)
+        {
+            if (txn_record(ptrs[i]) != 0)
+            {
+                // out of log space, hand back what cannot be tracked
+                for (size_t j = i; j < got; j++)
+                    drop(ptrs[j]);
+                settle();
+                got = i;
+                break;
+            }
+        }
+    }
+    UNLOCK();
+    return got;
+}
+
+/**
+ * @brief free `n` blocks under one lock acquisition, coalescing once.
+ *
+ * NULL entries are skipped.
+ */
+void dm_free_batch(void **ptrs, size_t n)
+{
+    LOCK();
+    for (size_t i = 0; i < n; i++)
+        drop(ptrs[i]);
+    settle();
+    UNLOCK();
+}
+
+/**
+ * @brief open an allocation scope on the calling thread.
+ *
+ * Every block mmalloc'd until the matching commit or rollback is recorded,
+ * so dm_txn_rollback can free all of them at once. Scopes nest; committing
+ * an inner scope hands its blocks to the enclosing one. A recorded block
+ * may be freed by any thread before the rollback, which then skips it. A
+ * thread that exits with scopes still open keeps their blocks, as if
+ * committed.
+ *
+ * @return 0 on success, -1 with errno EBUSY if scopes are nested too deep
+ */
+int dm_txn_begin()
+{
+    if (txn.depth == DM_TXN_MAX_DEPTH)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+    pthread_once(&txn_key_once, txn_make_key);
+    if (txn.depth == 0)
+        pthread_setspecific(txn_key, &txn);
+    txn.marks[txn.depth++] = txn.count;
+    return 0;
+}
+
+/**
+ * @brief close the innermost scope and keep its blocks.
+ */
+void dm_txn_commit()
+{
+    if (txn.depth == 0)
+        return;
+    txn.depth--;
+    if (txn.depth == 0)
+    {
+        // nobody left to roll them back
+        LOCK();
+        txn_drop_entries(&txn, 0);
+        UNLOCK();
+    }
+}
+
+/**
+ * @brief close the innermost scope and free every block allocated in it.
+ *
+ * Blocks are marked free in one pass and coalesced once at the end,
+ * instead of once per block as separate mfree calls would.
+ */
+void dm_txn_rollback()
+{
+    if (txn.depth == 0)
+        return;
+    size_t mark = txn.marks[--txn.depth];
+    LOCK();
+    for (size_t i = mark; i < txn.count && !shutting_down; i++)
+    {
+        size_t slot = txn_owner_find(txn.blocks[i]);
+        if (slot == txn_owner_cap || txn_owner[slot].log != &txn)
+            continue; // freed since, maybe by another thread
+        txn_owner_remove(slot);
+        release_ptr(txn.blocks[i]);
+    }
+    txn_drop_entries(&txn, mark);
+    if (!shutting_down)
+        coalesce();
+    UNLOCK();
+}
+
+/**
+ * @brief give the physical pages inside free blocks back to the OS.
+ *
+ * Only whole pages strictly inside a free payload are released, block
+ * headers stay resident. The address range stays valid and reads back as
+ * zeros, so the blocks are reused as usual.
+ *
+ * @return number of bytes released
+ */
+static size_t purge_free_pages()
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t released = 0;
+    if (shutting_down)
+        return 0;
+
+    for (BlockHeader *curr = head; curr; curr = curr->next)
+    {
+        if (!curr->free)
+            continue;
+        uintptr_t start = align_up((uintptr_t)(curr + 1), page);
+        uintptr_t end = (uintptr_t)block_end(curr) & ~(uintptr_t)(page - 1);
+        if (end <= start)
+            continue;
+        if (madvise((void *)start, end - start, MADV_DONTNEED) == 0)
+            released += end - start;
+    }
+
+    stats.purged_bytes += released;
+    return released;
+}
+
+size_t dm_purge()
+{
+    LOCK();
+    size_t released = purge_free_pages();
+    UNLOCK();
+    return released;
+}
+
+#define PM_PRESENT (1ull << 63)
+#define PM_SWAPPED (1ull << 62)
+#define PM_SOFT_DIRTY (1ull << 55)
+#define PM_PFN(e) ((e) & ((1ull << 55) - 1))
+#define WS_BATCH 512 // pagemap entries read at a time
+
+static int ws_method = DM_WS_MINCORE; // chosen by dm_ws_mark_idle
+
+/**
+ * @brief visit every page under the heap once, WS_BATCH pagemap entries
+ * at a time.
+ *
+ * Blocks are in address order, so a page shared by two blocks is only
+ * visited for the first. `inside_free` tells if a page lies entirely in
+ * a free payload. Without a pagemap (`fd` < 0) entries come from
+ * mincore and only carry PM_PRESENT.
+ *
+ * @return 0 on success, -1 if a page could not be read
+ */
+static int ws_walk(int fd, void (*visit)(uint64_t entry, int inside_free, void *arg), void *arg)
+{
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t seen = 0; // end of the last page visited
+    uint64_t entries[WS_BATCH];
+    unsigned char vec[WS_BATCH];
+
+    for (BlockHeader *curr = head; curr; curr = curr->next)
+    {
+        uintptr_t start = (uintptr_t)curr & ~(page - 1);
+        uintptr_t end = align_up((uintptr_t)block_end(curr), page);
+        uintptr_t free_start = align_up((uintptr_t)(curr + 1), page);
+        uintptr_t free_end = (uintptr_t)block_end(curr) & ~(page - 1);
+        if (start < seen)
+            start = seen;
+
+        while (start < end)
+        {
+            size_t n = (end - start) / page;
+            if (n > WS_BATCH)
+                n = WS_BATCH;
+            if (fd >= 0)
+            {
+                off_t off = (off_t)(start / page * sizeof(uint64_t));
+                if (pread(fd, entries, n * sizeof(uint64_t), off) != (ssize_t)(n * sizeof(uint64_t)))
+                    return -1;
+            }
+            else
+            {
+                if (mincore((void *)start, n * page, vec) != 0)
+                    return -1;
+                for (size_t i = 0; i < n; i++)
+                    entries[i] = (vec[i] & 1) ? PM_PRESENT : 0;
+            }
+            for (size_t i = 0; i < n; i++)
+            {
+                uintptr_t addr = start + i * page;
+                int inside_free = is_free(curr) && addr >= free_start && addr < free_end;
+                visit(entries[i], inside_free, arg);
+            }
+            start += n * page;
+        }
+        seen = end;
+    }
+    return 0;
+}
+
+typedef struct WsScan
+{
+    DmWorkingSet *ws;
+    int idle_fd; // page_idle bitmap, -1 if unused
+    size_t page;
+} WsScan;
+
+static void ws_mark_page(uint64_t entry, int inside_free, void *arg)
+{
+    (void)inside_free;
+    WsScan *scan = arg;
+    if (!(entry & PM_PRESENT) || PM_PFN(entry) == 0)
+        return;
+    uint64_t pfn = PM_PFN(entry);
+    uint64_t bit = 1ull << (pfn % 64);
+    // setting a bit marks the page idle, zero bits are ignored
+    pwrite(scan->idle_fd, &bit, sizeof(bit), (off_t)(pfn / 64 * sizeof(uint64_t)));
+}
+
+static void ws_count_page(uint64_t entry, int inside_free, void *arg)
+{
+    WsScan *scan = arg;
+    DmWorkingSet *ws = scan->ws;
+    if (!(entry & PM_PRESENT))
+        return;
+
+    int hot = 1;
+    if (ws->method == DM_WS_SOFT_DIRTY)
+        hot = (entry & PM_SOFT_DIRTY) != 0;
+    else if (ws->method == DM_WS_PAGE_IDLE && PM_PFN(entry))
+    {
+        uint64_t pfn = PM_PFN(entry), word = 0;
+        pread(scan->idle_fd, &word, sizeof(word), (off_t)(pfn / 64 * sizeof(uint64_t)));
+        hot = !(word & (1ull << (pfn % 64)));
+    }
+
+    ws->resident_bytes += scan->page;
+    if (hot)
+        ws->hot_bytes += scan->page;
+    else
+        ws->cold_bytes += scan->page;
+    if (inside_free)
+        ws->free_resident_bytes += scan->page;
+}
+
+/**
+ * @brief start a working set interval: mark every heap page idle.
+ *
+ * Uses /sys/kernel/mm/page_idle when the process may read page frame
+ * numbers (usually root), else the soft-dirty bits of /proc/self/pagemap,
+ * which only see writes and are reset for the whole process. Without
+ * either, dm_ws_sample falls back to mincore and can only tell resident
+ * pages, all of them counted hot.
+ *
+ * @return the DM_WS_* method in use until the next mark
+ */
+int dm_ws_mark_idle()
+{
+    LOCK();
+    ws_method = DM_WS_MINCORE;
+    int pm = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    int idle = open("/sys/kernel/mm/page_idle/bitmap", O_RDWR | O_CLOEXEC);
+    if (pm >= 0 && idle >= 0)
+    {
+        WsScan scan = {NULL, idle, (size_t)sysconf(_SC_PAGESIZE)};
+        uint64_t probe = 0;
+        // without CAP_SYS_ADMIN the pagemap reports every PFN as zero
+        volatile char *touch = (volatile char *)&probe;
+        *touch = 0;
+        pread(pm, &probe, sizeof(probe), (off_t)((uintptr_t)&probe / scan.page * sizeof(uint64_t)));
+        if (PM_PFN(probe) && ws_walk(pm, ws_mark_page, &scan) == 0)
+            ws_method = DM_WS_PAGE_IDLE;
+    }
+    if (ws_method == DM_WS_MINCORE && pm >= 0)
+    {
+        int refs = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+        if (refs >= 0)
+        {
+            uint64_t probe = 0;
+            volatile uint64_t *touch = &probe;
+            if (write(refs, "4", 1) == 1)
+            {
+                // clear_refs succeeds even on kernels without soft-dirty,
+                // check that a write to the stack shows up
+                *touch = 0;
+                off_t off = (off_t)((uintptr_t)&probe / (uintptr_t)sysconf(_SC_PAGESIZE) * sizeof(uint64_t));
+                if (pread(pm, &probe, sizeof(probe), off) == sizeof(probe) && (probe & PM_SOFT_DIRTY))
+                    ws_method = DM_WS_SOFT_DIRTY;
+            }
+            close(refs);
+        }
+    }
+    if (idle >= 0)
+        close(idle);
+    if (pm >= 0)
+        close(pm);
+    int method = ws_method;
+    UNLOCK();
+    return method;
+}
+
+/**
+ * @brief measure hot and cold resident heap bytes since dm_ws_mark_idle.
+ *
+ * The estimate is per page: a page with one hot byte is hot. Sample at
+ * a fixed period after each mark to get a time series; cold and
+ * free_resident_bytes are what purging or a cold arena would win.
+ *
+ * @return 0 on success, -1 if the pages could not be read
+ */
+int dm_ws_sample(DmWorkingSet *out)
+{
+    memset(out, 0, sizeof(*out));
+    LOCK();
+    out->method = ws_method;
+    WsScan scan = {out, -1, (size_t)sysconf(_SC_PAGESIZE)};
+    int pm = -1;
+    if (ws_method != DM_WS_MINCORE)
+        pm = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if (ws_method == DM_WS_PAGE_IDLE)
+        scan.idle_fd = open("/sys/kernel/mm/page_idle/bitmap", O_RDONLY | O_CLOEXEC);
+    if (pm < 0 || (ws_method == DM_WS_PAGE_IDLE && scan.idle_fd < 0))
+        out->method = DM_WS_MINCORE; // lost access since the mark
+    int rc = ws_walk(out->method == DM_WS_MINCORE ? -1 : pm, ws_count_page, &scan);
+    if (scan.idle_fd >= 0)
+        close(scan.idle_fd);
+    if (pm >= 0)
+        close(pm);
+    UNLOCK();
+    return rc;
+}
+
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE 25 // Linux 6.1
+#endif
+#define HUGE_PAGE ((uintptr_t)2 << 20)
+#define COLLAPSE_DENSE 7            // in-use eighths of a range worth collapsing
+#define COLLAPSE_MAX_RANGES 64      // ranges per call
+#define COLLAPSE_INTERVAL 1000000000 // ns between calls
+#define COLLAPSE_BUDGET (8u << 20)  // default bytes per call
+
+static uint64_t last_collapse_ns = 0;
+static int collapse_unsupported = 0; // MADV_COLLAPSE failed with EINVAL once
+
+/**
+ * @brief AnonHugePages of the mappings overlapping [lo, hi), from smaps.
+ */
+static size_t huge_coverage(uintptr_t lo, uintptr_t hi)
+{
+    FILE *f = fopen("/proc/self/smaps", "re");
+    if (!f)
+        return 0;
+    char line[256];
+    size_t total = 0;
+    int inside = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        unsigned long start, end, kb;
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+            inside = start < hi && end > lo;
+        else if (inside && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+            total += (size_t)kb << 10;
+    }
+    fclose(f);
+    return total;
+}
+
+/**
+ * @brief 2 MiB aligned heap ranges where at least COLLAPSE_DENSE eighths
+ * of the bytes are in use, in address order.
+ *
+ * @return number of ranges stored in `out`
+ */
+static size_t dense_ranges(uintptr_t *out, size_t max)
+{
+    size_t n = 0;
+    uintptr_t window = 0; // start of the range being summed
+    size_t used = 0;
+    for (BlockHeader *curr = head; curr && n < max; curr = curr->next)
+    {
+        uintptr_t lo = (uintptr_t)curr, hi = (uintptr_t)block_end(curr);
+        while (lo < hi && n < max)
+        {
+            uintptr_t w = lo & ~(HUGE_PAGE - 1);
+            if (w != window)
+            {
+                if (window && used >= HUGE_PAGE / 8 * COLLAPSE_DENSE)
+                    out[n++] = window;
+                window = w;
+                used = 0;
+            }
+            uintptr_t stop = hi < w + HUGE_PAGE ? hi : w + HUGE_PAGE;
+            if (!is_free(curr))
+                used += stop - lo;
+            lo = stop;
+        }
+    }
+    if (n < max && window && used >= HUGE_PAGE / 8 * COLLAPSE_DENSE)
+        out[n++] = window;
+    return n;
+}
+
+/**
+ * @brief back densely used, fully resident heap ranges with huge pages.
+ *
+ * Asks for MADV_COLLAPSE on up to `budget` bytes (0 for 8 MiB) of 2 MiB
+ * aligned ranges that are mostly in use, so long-lived data grown
+ * through many small sbrk calls stops costing a TLB entry per 4 KiB.
+ * Ranges with pages not resident are skipped, collapsing them would
+ * fault those in. Kernels without MADV_COLLAPSE get MADV_HUGEPAGE, and
+ * khugepaged collapses later. Inherited ranges are left alone in `cow`
+ * mode. Call it from a maintenance thread; it runs at most once per
+ * second and only holds the lock while choosing ranges.
+ *
+ * @return 0 on success, -1 with errno EAGAIN if called again too soon
+ */
+int dm_collapse_hot(size_t budget, DmCollapseReport *out)
+{
+    memset(out, 0, sizeof(*out));
+    uint64_t now = now_ns();
+    uintptr_t ranges[COLLAPSE_MAX_RANGES];
+    size_t max = (budget ? budget : COLLAPSE_BUDGET) / HUGE_PAGE;
+    if (max > COLLAPSE_MAX_RANGES)
+        max = COLLAPSE_MAX_RANGES;
+
+    LOCK();
+    if (last_collapse_ns && now - last_collapse_ns < COLLAPSE_INTERVAL)
+    {
+        UNLOCK();
+        errno = EAGAIN;
+        return -1;
+    }
+    last_collapse_ns = now;
+    size_t n = dense_ranges(ranges, max);
+    uintptr_t lo = head ? (uintptr_t)head : 0;
+    uintptr_t hi = tail ? (uintptr_t)block_end(tail) : 0;
+    char *frozen_below = cow_limit;
+    int method = collapse_unsupported ? DM_COLLAPSE_HINT : DM_COLLAPSE_SYNC;
+    UNLOCK();
+
+    out->method = method;
+    out->huge_before = huge_coverage(lo, hi);
+    unsigned char vec[HUGE_PAGE / 4096];
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < n; i++)
+    {
+        char *range = (char *)ranges[i];
+        if (range < frozen_below)
+            continue;
+        if (mincore(range, HUGE_PAGE, vec) != 0)
+            continue; // trimmed meanwhile, or not all ours
+        size_t resident = 0;
+        for (size_t p = 0; p < HUGE_PAGE / page; p++)
+            resident += vec[p] & 1;
+        if (resident < HUGE_PAGE / page)
+            continue;
+
+        out->candidates++;
+        if (out->method == DM_COLLAPSE_SYNC && madvise(range, HUGE_PAGE, MADV_COLLAPSE) != 0 && errno == EINVAL)
+        {
+            __atomic_store_n(&collapse_unsupported, 1, __ATOMIC_RELAXED);
+            out->method = DM_COLLAPSE_HINT;
+        }
+        else if (out->method == DM_COLLAPSE_SYNC)
+        {
+            out->collapsed_bytes += HUGE_PAGE;
+            continue;
+        }
+        if (madvise(range, HUGE_PAGE, MADV_HUGEPAGE) == 0)
+            out->collapsed_bytes += HUGE_PAGE;
+    }
+    out->huge_after = huge_coverage(lo, hi);
+    return 0;
+}
+
+/**
+ * @brief parse a size with an optional k/m/g suffix.
+ *
+ * @return 0 on success, -1 if `value` is not a size
+ */
+static int parse_size(const char *value, size_t len, size_t *out)
+{
+    char buf[32];
+    if (len == 0 || len >= sizeof(buf))
+        return -1;
+    memcpy(buf, value, len);
+    buf[len] = '\0';
+
+    char *end;
+    unsigned long long n = strtoull(buf, &end, 10);
+    if (end == buf)
+        return -1;
+    switch (*end)
+    {
+    case 'g':
+        n <<= 10; // fall through
+    case 'm':
+        n <<= 10; // fall through
+    case 'k':
+        n <<= 10;
+        end++;
+        break;
+    }
+    if (*end != '\0')
+        return -1;
+    *out = (size_t)n;
+    return 0;
+}
+
+/**
+ * @brief apply one `key:value` option to `cfg`.
+ *
+ * @return 0 on success, -1 for an unknown key or a bad value
+ */
+static int apply_option(HeapConfig *cfg, const char *opt, size_t len)
+{
+    const char *colon = memchr(opt, ':', len);
+    if (!colon)
+        return -1;
+    size_t klen = colon - opt;
+    const char *value = colon + 1;
+    size_t vlen = len - klen - 1;
+
+#define KEY_IS(k) (klen == sizeof(k) - 1 && memcmp(opt, k, klen) == 0)
+#define VALUE_IS(v) (vlen == sizeof(v) - 1 && memcmp(value, v, vlen) == 0)
+    if (KEY_IS("fit"))
+    {
+        if (VALUE_IS("first"))
+            cfg->fit = DM_FIT_FIRST;
+        else if (VALUE_IS("best"))
+            cfg->fit = DM_FIT_BEST;
+        else
+            return -1;
+        return 0;
+    }
+    if (KEY_IS("coalesce"))
+    {
+        if (VALUE_IS("eager"))
+            cfg->lazy_coalesce = 0;
+        else if (VALUE_IS("lazy"))
+            cfg->lazy_coalesce = 1;
+        else
+            return -1;
+        return 0;
+    }
+    if (KEY_IS("grow"))
+        return parse_size(value, vlen, &cfg->grow);
+    if (KEY_IS("trim"))
+        return parse_size(value, vlen, &cfg->trim);
+    if (KEY_IS("fast_exit"))
+    {
+        if (VALUE_IS("0"))
+            cfg->fast_exit = 0;
+        else if (VALUE_IS("1"))
+            cfg->fast_exit = 1;
+        else
+            return -1;
+        return 0;
+    }
+    if (KEY_IS("cow"))
+    {
+        if (VALUE_IS("0"))
+            cfg->cow = 0;
+        else if (VALUE_IS("1"))
+            cfg->cow = 1;
+        else
+            return -1;
+        return 0;
+    }
+    if (KEY_IS("budget"))
+        return parse_size(value, vlen, &cfg->budget);
+    if (KEY_IS("numa_nodes"))
+        return parse_size(value, vlen, &cfg->numa_nodes);
+    if (KEY_IS("classes"))
+    {
+        if (VALUE_IS("0"))
+            cfg->classes = 0;
+        else if (VALUE_IS("1"))
+            cfg->classes = 1;
+        else
+            return -1;
+        return 0;
+    }
+    if (KEY_IS("lifetime"))
+        return parse_size(value, vlen, &cfg->lifetime);
+    if (KEY_IS("profile"))
+    {
+        if (vlen >= sizeof(cfg->profile))
+            return -1;
+        memcpy(cfg->profile, value, vlen);
+        cfg->profile[vlen] = '\0';
+        return 0;
+    }
+#undef KEY_IS
+#undef VALUE_IS
+    return -1;
+}
+
 /**
- * @brief Round up `size` to the closest factor of `align`
- *
- * @param size the number to round up
- * @param align factor to round up
+ * @brief apply a `key:value,key:value` string on top of `cfg`.
+ */
+static int parse_config(HeapConfig *cfg, const char *conf)
+{
+    while (*conf)
+    {
+        const char *comma = strchr(conf, ',');
+        size_t len = comma ? (size_t)(comma - conf) : strlen(conf);
+        if (len > 0 && apply_option(cfg, conf, len) != 0)
+            return -1;
+        conf += len;
+        if (*conf == ',')
+            conf++;
+    }
+    return 0;
+}
+
+/**
+ * @brief make room for `bytes` of free memory at the top in one sbrk.
  *
- * @return rounded up size
+ * @return 0 on success, -1 if the heap could not grow
  */
-static inline size_t align_up(size_t size, size_t align)
+static int reserve_top(size_t bytes)
 {
+    bytes = align_up(bytes, ALIGN);
+    if (tail && tail->free && block_end(tail) == (char *)sbrk(0))
+    {
+        if (tail->size >= bytes)
+            return 0;
+        size_t missing = bytes - tail->size;
+        if (heap_sbrk(missing) == (void *)-1)
+            return -1;
+        tail->size += missing;
+        return 0;
+    }
 
-    return (size + (align - 1)) & ~(align - 1);
+    void *mem_ptr = heap_sbrk(sizeof(BlockHeader) + bytes);
+    if (mem_ptr == (void *)-1)
+        return -1;
+    append(mem_ptr, bytes)->free = 1;
+    return 0;
 }
 
 /**
- * @brief Create a block and append it to the list
+ * @brief pre-reserve the heap for a known demand.
  *
- * @param mem_ptr current program break pointer
- * @param size size of the block to allocate
+ * Grows the heap once for `counts[i]` blocks of `sizes[i]` bytes each,
+ * instead of one sbrk per block as the first allocations would. The room
+ * is kept as one free block at the top; separate pre-carved blocks would
+ * merge back on the first mfree anyway.
  *
- * @returns pointer to the allocated block
+ * @return 0 on success, -1 if the heap could not grow
  */
-BlockHeader *append(void *mem_ptr, size_t size)
+static int heap_warmup(const size_t *sizes, const size_t *counts, size_t n)
 {
-    BlockHeader *block = (BlockHeader *)mem_ptr; /* tells complier to treat `mem_ptr` as the starting of `BlockHeader` and also tells that data will be stored in the structure of `BlockHeader` */
-    block->size = size;                          // payload size only
-    block->free = 0;
-    block->next = NULL;
-    if (!head)
-    {
-        head = block;
-    }
-    else
+    if (!config_loaded)
+        load_env_config();
+    size_t total = 0;
+    for (size_t i = 0; i < n; i++)
+        total += counts[i] * (sizeof(BlockHeader) + align_up(sizes[i], ALIGN));
+    if (total == 0)
+        return 0;
+    return reserve_top(total - sizeof(BlockHeader));
+}
+
+int dm_warmup(const size_t *sizes, const size_t *counts, size_t n)
+{
+    LOCK();
+    int rc = heap_warmup(sizes, counts, n);
+    UNLOCK();
+    return rc;
+}
+
+/**
+ * @brief at exit, write each class's peak demand to the profile file.
+ */
+static void write_profile()
+{
+    if (!config.profile[0])
+        return;
+    FILE *f = fopen(config.profile, "w");
+    if (!f)
+        return;
+    fprintf(f, "# dm_alloc warm-up profile\n");
+    fprintf(f, "heap %zu\n", stats.peak_heap_bytes);
+    for (int k = 0; k < DM_CLASSES; k++)
     {
-        BlockHeader *curr = head;
-        while (curr->next != NULL)
-        {
-            curr = curr->next;
-        }
-        curr->next = block;
+        if (class_peak[k])
+            fprintf(f, "class %zu %zu\n", (size_t)1 << k, class_peak[k]);
     }
-    return block;
+    fclose(f);
+}
+
+static void save_profile()
+{
+    LOCK();
+    write_profile();
+    UNLOCK();
 }
 
 /**
- * @brief allocates `block` of memory
- * @param size size of the payload
+ * @brief warm up from the profile file if there is one, and save it at exit.
  *
- * @return ptr to the payload
+ * The reservation is the recorded peak heap size when known, since class
+ * sizes are upper bounds and overestimate the demand.
  */
-void *mmalloc(size_t size)
+static void start_profile()
 {
+    static int registered = 0;
+    if (!registered && atexit(save_profile) == 0)
+        registered = 1;
 
-    if (size == 0)
-        return NULL;
-
-    size_t asize = align_up(size, ALIGN); // aligned size
+    FILE *f = fopen(config.profile, "r");
+    if (!f)
+        return; // first run, nothing recorded yet
 
-    // check for free blocks
-
-    BlockHeader *block = find_free(asize);
-    if (block)
+    size_t sizes[DM_CLASSES], counts[DM_CLASSES];
+    size_t n = 0, heap = 0, a, b;
+    char line[128];
+    while (fgets(line, sizeof(line), f))
     {
-        block->free = 0;
-        return (block + 1);
+        if (sscanf(line, "heap %zu", &a) == 1)
+            heap = a;
+        else if (n < DM_CLASSES && sscanf(line, "class %zu %zu", &a, &b) == 2)
+        {
+            sizes[n] = a;
+            counts[n++] = b;
+        }
     }
+    fclose(f);
 
-    // void *prev_brk = sbrk(0); // get current program break
-    size_t total_size = sizeof(BlockHeader) + asize;
+    if (heap > sizeof(BlockHeader))
+        reserve_top(heap - sizeof(BlockHeader));
+    else
+        heap_warmup(sizes, counts, n);
+}
 
-    void *mem_ptr = sbrk(total_size); // ptr of the current program break and inc by total_size
+/**
+ * @brief atexit hook for the fast_exit option.
+ */
+static void fast_exit_hook()
+{
+    if (config.fast_exit)
+        dm_begin_shutdown();
+}
 
-    if (mem_ptr == (void *)-1)
-        return NULL; // abrk failed
+/**
+ * @brief register fast_exit_hook once.
+ *
+ * atexit runs hooks newest first, so only frees made by hooks registered
+ * before this one are skipped. Call dm_begin_shutdown yourself to cover
+ * everything after main.
+ */
+static void start_fast_exit()
+{
+    static int registered = 0;
+    if (!registered && atexit(fast_exit_hook) == 0)
+        registered = 1;
+}
 
-    block = append(mem_ptr, asize);
+static void fork_prepare()
+{
+    LOCK();
+    pthread_mutex_lock(&region_lock);
+}
 
-    return (block + 1); /* skips header and returns the ptr to the payload*/
+static void fork_release()
+{
+    pthread_mutex_unlock(&region_lock);
+    UNLOCK();
 }
 
-void *mcalloc(size_t num, size_t size)
+/**
+ * @brief in the child, reset the lock and freeze everything inherited
+ * when `cow` is on.
+ *
+ * The lock cannot just be unlocked: a recursive mutex remembers the
+ * parent's thread as its owner, which does not exist in the child.
+ */
+static void fork_child()
 {
-    size_t total_size = num * size;
-    void *ptr = mmalloc(total_size);
-    if (ptr == NULL)
+    pthread_mutex_t fresh = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+    pthread_mutex_t plain = PTHREAD_MUTEX_INITIALIZER;
+    heap_lock = fresh;
+    region_lock = plain;
+    if (config.cow)
     {
-        return NULL; // malloc failed
+        cow_limit = (char *)sbrk(0);
+        for (int c = 0; c < REGION_CLASSES; c++)
+            region_frozen[c] = region_bumped[c];
     }
-    // Set all bytes in the allocated block to 0
-    memset(ptr, 0, total_size);
-    return ptr;
 }
 
-void *mrelloc(void *ptr, size_t size)
+/**
+ * @brief read DM_ALLOC_CONF once, a malformed string is ignored as a whole.
+ */
+static void load_env_config()
 {
-    if (ptr == NULL)
+    config_loaded = 1;
+    // a child must not inherit the lock held by another thread
+    pthread_atfork(fork_prepare, fork_release, fork_child);
+    const char *conf = getenv("DM_ALLOC_CONF");
+    HeapConfig cfg = config;
+    if (conf && parse_config(&cfg, conf) == 0)
+        config = cfg;
+    if (config.profile[0])
+        start_profile();
+    if (config.fast_exit)
+        start_fast_exit();
+    __atomic_store_n(&config_ready, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief change the tunables.
+ *
+ * `conf` uses the DM_ALLOC_CONF syntax, for example
+ * "fit:best,coalesce:lazy,grow:64k":
+ * - fit: first | best, how find_free picks a block.
+ * - coalesce: eager (on every mfree) | lazy (only when an allocation misses).
+ * - grow: minimum bytes asked from sbrk at a time, the rest stays free.
+ * - trim: once the free top of the heap exceeds this, mfree lowers the
+ *   break down to `grow` bytes. 0 (the default) never trims.
+ * - fast_exit: 1 to call dm_begin_shutdown from an atexit hook.
+ * - cow: 1 so forked children never write the headers they inherited,
+ *   keeping those heap pages shared with the parent (see frozen()).
+ * - classes: 1 to serve blocks up to 32 KiB from per-class address
+ *   ranges without headers, so mfree and dm_malloc_usable_size find the
+ *   size from the address alone. Blocks already allocated stay valid
+ *   when it is switched either way.
+ * - budget: bytes in use (all kinds of blocks) allocations may not take
+ *   the heap over. mmalloc fails with ENOMEM instead, dm_malloc_wait
+ *   waits for frees. 0 (the default) means no budget.
+ * - numa_nodes: pretend the machine has this many NUMA nodes. mbind is
+ *   skipped and dm_numa_residency reports where each policy would have
+ *   put the pages. 0 (the default) uses the real topology.
+ * - lifetime: sample one allocation in this many for the lifetime
+ *   profiler, 0 (the default) turns it off. See dm_lifetime_dump.
+ * - profile: path of a warm-up profile. If it exists the heap is reserved
+ *   from it right away, and it is rewritten with this run's demand at exit.
+ *
+ * DM_ALLOC_CONF is applied first, so explicit calls override it.
+ *
+ * @return 0 on success, -1 with errno EINVAL if `conf` is malformed,
+ * in which case nothing changes
+ */
+static int configure(const char *conf)
+{
+    if (!config_loaded)
+        load_env_config();
+    HeapConfig cfg = config;
+    if (!conf || parse_config(&cfg, conf) != 0)
     {
-        // realloc(NULL, size) is equivalent to malloc(size)
-        return mmalloc(size);
+        errno = EINVAL;
+        return -1;
     }
-    if (size == 0)
+    int new_profile = strcmp(cfg.profile, config.profile) != 0;
+    config = cfg;
+    if (waitq && !config.budget)
     {
-        // realloc(ptr, 0) is equivalent to free(ptr)
-        mfree(ptr);
-        return NULL;
+        // nothing to wait for any more, let every waiter go
+        for (BudgetWaiter *w = waitq; w; w = w->next)
+        {
+            __atomic_store_n(&w->ready, 1, __ATOMIC_RELEASE);
+            syscall(SYS_futex, &w->ready, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+        }
     }
+    else if (waitq)
+        budget_wake(); // a bigger budget may fit the first waiter
+    if (new_profile && config.profile[0])
+        start_profile();
+    if (config.fast_exit)
+        start_fast_exit();
+    return 0;
+}
 
-    BlockHeader *header = (BlockHeader *)ptr - 1;
+int dm_configure(const char *conf)
+{
+    LOCK();
+    int rc = configure(conf);
+    UNLOCK();
+    return rc;
+}
 
-    if (header->size == size)
-    {
-        return header + 1;
-    }
+/**
+ * @brief copy the current tunables
+ */
+void dm_get_config(HeapConfig *out)
+{
+    LOCK();
+    if (!config_loaded)
+        load_env_config();
+    if (out)
+        *out = config;
+    UNLOCK();
+}
 
-    if (header->size > size)
-    {
-        return split_block(header, size);
-    }
+/**
+ * @brief glibc mallinfo2, from the counters instead of walking the heap.
+ */
+DmMallinfo dm_mallinfo2()
+{
+    DmMallinfo mi = {0};
+    LOCK();
+    // class region blocks are bumped without the lock
+    size_t region_bytes = __atomic_load_n(&stats.region_bytes, __ATOMIC_RELAXED);
+    size_t region_in_use = __atomic_load_n(&stats.region_in_use_bytes, __ATOMIC_RELAXED);
+    mi.arena = stats.heap_bytes + region_bytes;
+    mi.ordblks = stats.blocks - stats.used_blocks;
+    mi.hblks = stats.mmap_blocks;
+    mi.hblkhd = stats.mmap_bytes;
+    mi.uordblks = stats.in_use_bytes + region_in_use;
+    mi.fordblks = stats.heap_bytes - stats.in_use_bytes - stats.blocks * sizeof(BlockHeader) +
+                  region_bytes - region_in_use;
+    if (tail && tail->free)
+        mi.keepcost = tail->size;
+    UNLOCK();
+    return mi;
+}
 
-    if (header->size < size && header->next->free)
-    {
+/**
+ * @brief glibc malloc_stats, same layout on stderr.
+ */
+void dm_malloc_stats()
+{
+    HeapStats st;
+    dm_get_stats(&st);
+    fprintf(stderr, "Arena 0:\n");
+    fprintf(stderr, "system bytes     = %10zu\n", st.heap_bytes);
+    fprintf(stderr, "in use bytes     = %10zu\n", st.in_use_bytes);
+    fprintf(stderr, "Total (incl. mmap):\n");
+    fprintf(stderr, "system bytes     = %10zu\n", st.heap_bytes + st.mmap_bytes);
+    fprintf(stderr, "in use bytes     = %10zu\n", st.in_use_bytes + st.mmap_bytes);
+    fprintf(stderr, "max mmap regions = %10zu\n", st.mmap_peak_blocks);
+    fprintf(stderr, "max mmap bytes   = %10zu\n", st.mmap_peak_bytes);
+}
+
+/**
+ * @brief glibc malloc_trim: shrink the top of the heap to `pad` bytes and
+ * release the pages inside the other free blocks.
+ *
+ * @return 1 if any memory was given back, else 0
+ */
+static int heap_trim(size_t pad)
+{
+    if (shutting_down)
+        return 0;
+    if (config.lazy_coalesce)
         coalesce();
-        if (header->size > size)
-        {
-            return split_block(header, size);
-        }
-    }
+    int released = trim_top(pad);
+    if (purge_free_pages() > 0)
+        released = 1;
+    return released;
+}
 
-    else
-    {
-        BlockHeader *new_header = mmalloc(size);
-        mfree(ptr);
-        return new_header + 1;
-    }
+int dm_malloc_trim(size_t pad)
+{
+    LOCK();
+    int released = heap_trim(pad);
+    UNLOCK();
+    return released;
 }
+
 /**
- * @brief splits large free blocks for new allocations , if feastable
+ * @brief glibc mallopt over the tunables.
  *
- * @param block the free block for splitting
- * @param size size of the payload
+ * M_TRIM_THRESHOLD sets `trim` (negative turns it off) and M_TOP_PAD sets
+ * `grow`. There is no mmap path, so M_MMAP_MAX only accepts 0 and
+ * M_MMAP_THRESHOLD is refused.
  *
- * @return `block` for allocating data
+ * @return 1 on success, 0 for an unsupported parameter or value
  */
-BlockHeader *split_block(BlockHeader *block, size_t size)
+static int set_option(int param, int value)
 {
-    size_t asize = align_up(size, ALIGN);
-    // size : required size for the block
-    size_t leftover = block->size - asize - sizeof(BlockHeader);
-
-    // the min block size is sizeof(BlockHeader) + ALIGN, if leftover <= no use of splitting
-    if (leftover <= sizeof(BlockHeader) + ALIGN)
+    if (!config_loaded)
+        load_env_config();
+    switch (param)
     {
-        // not enough to split, use whole block
-        // free the block and use it
-        block->free = 0;
-        return block;
+    case DM_M_TRIM_THRESHOLD:
+        config.trim = value < 0 ? 0 : (size_t)value;
+        return 1;
+    case DM_M_TOP_PAD:
+        if (value < 0)
+            return 0;
+        config.grow = (size_t)value;
+        return 1;
+    case DM_M_MMAP_MAX:
+        return value == 0;
+    default:
+        return 0;
     }
-    // if its splittable
-    // create new Blockheader at leftover location
-
-    /* move new_block to skip current `block` header and asize(needed to store data)*/
-    BlockHeader *new_block = (BlockHeader *)((char *)(block + 1) + asize);
-
-    new_block->size = leftover;
-    new_block->free = 1;
-    new_block->next = block->next;
-
-    // update original block
-    block->size = asize;
-    block->free = 0;
-    block->next = new_block;
+}
 
-    return block; // the allocated part
+int dm_mallopt(int param, int value)
+{
+    LOCK();
+    int rc = set_option(param, value);
+    UNLOCK();
+    return rc;
 }
 
 /**
- * @brief finds a free block from the pre-allocated blocks.
- * @param size size of the block needed
+ * @brief glibc malloc_info, the same XML shape with a single heap.
  *
- * @return ptr of the free block on success, else NULL
+ * @return 0 on success, -1 with errno EINVAL if `options` is not 0
  */
-BlockHeader *find_free(size_t size)
+int dm_malloc_info(int options, FILE *stream)
 {
-    BlockHeader *curr = head;
-    while (curr != NULL)
+    if (options != 0)
     {
-        if (curr->free)
-        {
-            if (curr->size == size)
-            {
-                return curr; // perfect fit
-            }
-            if (curr->size >= size + sizeof(BlockHeader) + ALIGN)
-            {
-                return split_block(curr, size); // split
-            }
-            if (curr->size >= size)
-            {
-                // block is a bit bigger, but not enough to split
-                return curr;
-            }
-        }
-
-        curr = curr->next;
+        errno = EINVAL;
+        return -1;
     }
-    return NULL;
+    DmMallinfo mi = dm_mallinfo2();
+    HeapStats st;
+    dm_get_stats(&st);
+    fprintf(stream, "<malloc version=\"1\">\n");
+    fprintf(stream, "<heap nr=\"0\">\n<sizes>\n</sizes>\n");
+    fprintf(stream, "<total type=\"fast\" count=\"0\" size=\"0\"/>\n");
+    fprintf(stream, "<total type=\"rest\" count=\"%zu\" size=\"%zu\"/>\n", mi.ordblks, mi.fordblks);
+    fprintf(stream, "<system type=\"current\" size=\"%zu\"/>\n", st.heap_bytes);
+    fprintf(stream, "<system type=\"max\" size=\"%zu\"/>\n", st.peak_heap_bytes);
+    fprintf(stream, "<aspace type=\"total\" size=\"%zu\"/>\n", st.heap_bytes);
+    fprintf(stream, "<aspace type=\"mprotect\" size=\"%zu\"/>\n", st.heap_bytes);
+    fprintf(stream, "</heap>\n");
+    fprintf(stream, "<total type=\"fast\" count=\"0\" size=\"0\"/>\n");
+    fprintf(stream, "<total type=\"rest\" count=\"%zu\" size=\"%zu\"/>\n", mi.ordblks, mi.fordblks);
+    fprintf(stream, "<total type=\"mmap\" count=\"%zu\" size=\"%zu\"/>\n", mi.hblks, mi.hblkhd);
+    fprintf(stream, "<system type=\"current\" size=\"%zu\"/>\n", st.heap_bytes);
+    fprintf(stream, "<system type=\"max\" size=\"%zu\"/>\n", st.peak_heap_bytes);
+    fprintf(stream, "<aspace type=\"total\" size=\"%zu\"/>\n", st.heap_bytes);
+    fprintf(stream, "<aspace type=\"mprotect\" size=\"%zu\"/>\n", st.heap_bytes);
+    fprintf(stream, "</malloc>\n");
+    return 0;
 }
 
 /**
- * @brief join free blocks
+ * @brief enter fast exit mode, for processes that are about to exit.
+ *
+ * From now on mfree only counts the call (HeapStats.skipped_frees) and
+ * trimming, purging and rollbacks do nothing, so teardown code that frees
+ * millions of blocks does not pay for coalescing memory the OS is about
+ * to reclaim. There is no way back.
  */
-void coalesce()
+void dm_begin_shutdown()
 {
-    BlockHeader *curr = head;
+    LOCK();
+    shutting_down = 1;
+    UNLOCK();
+}
 
-    while (curr && curr->next)
+/**
+ * @brief print the lifetime histograms of sampled blocks.
+ *
+ * One row per size class and one per callsite (a return address, see
+ * addr2line) with the number of sampled blocks that died at each age,
+ * plus the sampled blocks still alive per callsite. Short lived classes
+ * and sites are candidates for arenas, long lived ones for pools.
+ */
+void dm_lifetime_dump(FILE *out)
+{
+    static const char *labels[LIFE_BUCKETS] = {"<1us", "<10us", "<100us", "<1ms", "<10ms",
+                                               "<100ms", "<1s", "<10s", ">=10s"};
+    LOCK();
+    fprintf(out, "%-20s", "size class");
+    for (int b = 0; b < LIFE_BUCKETS; b++)
+        fprintf(out, " %8s", labels[b]);
+    fprintf(out, "\n");
+    for (int k = 0; k < DM_CLASSES; k++)
     {
-        if (curr->free && curr->next->free)
-        {
-            // merge curr with next
-            size_t prev_size = curr->size;
-            curr->size += sizeof(BlockHeader) + curr->next->size;
-            curr->next = curr->next->next;
-            // do not move curr forward — there might be more consecutive free blocks
-        }
-        else
-        {
-            curr = curr->next;
-        }
+        size_t total = 0;
+        for (int b = 0; b < LIFE_BUCKETS; b++)
+            total += life_ages[k][b];
+        if (!total)
+            continue;
+        fprintf(out, "<= %-17zu", (size_t)1 << k);
+        for (int b = 0; b < LIFE_BUCKETS; b++)
+            fprintf(out, " %8zu", life_ages[k][b]);
+        fprintf(out, "\n");
+    }
+
+    fprintf(out, "\n%-20s", "callsite");
+    for (int b = 0; b < LIFE_BUCKETS; b++)
+        fprintf(out, " %8s", labels[b]);
+    fprintf(out, " %8s\n", "live");
+    for (size_t i = 0; life_sites && i < LIFE_SITES; i++)
+    {
+        LifeSite *rec = &life_sites[i];
+        if (!rec->site)
+            continue;
+        fprintf(out, "%-20p", rec->site);
+        for (int b = 0; b < LIFE_BUCKETS; b++)
+            fprintf(out, " %8zu", rec->ages[b]);
+        fprintf(out, " %8zu\n", rec->live);
     }
+    if (life_dropped)
+        fprintf(out, "\n%zu samples dropped, sample table full\n", life_dropped);
+    UNLOCK();
 }
 
 /**
- * @brief free allocated blocks
+ * @brief copy the allocator counters
  *
- * @param ptr block pointer
+ * @param out filled with a snapshot of the counters
  */
-void mfree(void *ptr)
+void dm_get_stats(HeapStats *out)
 {
-    if (!ptr)
-        return;
-    /*
-    as in mmalloc, block -1 moves our ptr to
-    say 16 bytes backwards to the start of our
-    header.
-    */
-    BlockHeader *block = ((BlockHeader *)ptr) - 1;
-    block->free = 1;
-
-    // not so performance friendly
-    // memset(ptr, 0, block->size); // write the content t0 0
-
-    // coalescing
-    coalesce();
+    LOCK();
+    if (out)
+        *out = stats;
+    UNLOCK();
 }
 
 /**
@@ -265,12 +3197,59 @@ void mfree(void *ptr)
  */
 void print_heap()
 {
+    LOCK();
     BlockHeader *curr = head;
     printf("Heap blocks:\n");
     while (curr)
     {
         printf("  Block %p: size=%zu, free=%d, user_ptr=%p\n",
-               curr, curr->size, curr->free, (void *)(curr + 1));
+               curr, curr->size, is_free(curr), (void *)(curr + 1));
         curr = curr->next;
     }
+    UNLOCK();
+}
+
+#ifdef DM_GLIBC_COMPAT
+/*
+ * glibc names for the introspection calls, for builds that stand in for
+ * the libc allocator. Tools that include <malloc.h> get the real types.
+ */
+#include <malloc.h>
+
+struct mallinfo2 mallinfo2(void)
+{
+    DmMallinfo mi = dm_mallinfo2();
+    struct mallinfo2 out;
+    out.arena = mi.arena;
+    out.ordblks = mi.ordblks;
+    out.smblks = mi.smblks;
+    out.hblks = mi.hblks;
+    out.hblkhd = mi.hblkhd;
+    out.usmblks = mi.usmblks;
+    out.fsmblks = mi.fsmblks;
+    out.uordblks = mi.uordblks;
+    out.fordblks = mi.fordblks;
+    out.keepcost = mi.keepcost;
+    return out;
+}
+
+void malloc_stats(void)
+{
+    dm_malloc_stats();
+}
+
+int malloc_trim(size_t pad)
+{
+    return dm_malloc_trim(pad);
+}
+
+int mallopt(int param, int value)
+{
+    return dm_mallopt(param, value);
+}
+
+int malloc_info(int options, FILE *stream)
+{
+    return dm_malloc_info(options, stream);
 }
+#endif // DM_GLIBC_COMPAT
@@ -0,0 +1,167 @@
+#include "dm_arena.h"
+#include "dm_alloc.h"
+
+/**
+ * @brief round `addr` up to a multiple of `align` (a power of two)
+ */
+static inline uintptr_t align_addr(uintptr_t addr, size_t align)
+{
+    return (addr + (align - 1)) & ~(uintptr_t)(align - 1);
+}
+
+/**
+ * @brief adds a chunk that can hold at least `size` bytes at `align`
+ */
+static ArenaChunk *arena_grow(Arena *arena, size_t size, size_t align)
+{
+    size_t need = size + align;
+    size_t csize = need > arena->chunk_size ? need : arena->chunk_size;
+
+    ArenaChunk *chunk = mmalloc(sizeof(ArenaChunk) + csize);
+    if (!chunk)
+        return NULL;
+    chunk->size = csize;
+    chunk->used = 0;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    return chunk;
+}
+
+/**
+ * @brief bump `size` bytes at `align` out of the current chunk
+ */
+static void *arena_bump(Arena *arena, size_t size, size_t align)
+{
+    ArenaChunk *chunk = arena->chunks;
+    if (chunk)
+    {
+        uintptr_t base = (uintptr_t)(chunk + 1);
+        uintptr_t at = align_addr(base + chunk->used, align);
+        if (at + size <= base + chunk->size)
+        {
+            chunk->used = at + size - base;
+            return (void *)at;
+        }
+    }
+
+    chunk = arena_grow(arena, size, align);
+    if (!chunk)
+        return NULL;
+    uintptr_t base = (uintptr_t)(chunk + 1);
+    uintptr_t at = align_addr(base, align);
+    chunk->used = at + size - base;
+    return (void *)at;
+}
+
+/**
+ * @brief creates an empty arena
+ *
+ * An arena has no lock of its own: use it from one thread at a time.
+ *
+ * @param chunk_size payload size of each chunk, bigger requests get their own
+ *
+ * @return the arena, or NULL if mmalloc failed
+ */
+Arena *dm_arena_create(size_t chunk_size)
+{
+    Arena *arena = mmalloc(sizeof(Arena));
+    if (!arena)
+        return NULL;
+    arena->chunks = NULL;
+    arena->dtors = NULL;
+    arena->chunk_size = chunk_size ? chunk_size : 4096;
+    return arena;
+}
+
+/**
+ * @brief allocates from the arena, the memory lives until reset or destroy
+ *
+ * @param size bytes needed
+ * @param align power of two alignment, 0 for the default of 8
+ *
+ * @return ptr to the memory, NULL if the arena could not grow
+ */
+void *dm_arena_alloc(Arena *arena, size_t size, size_t align)
+{
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+    return arena_bump(arena, size, align);
+}
+
+/**
+ * @brief like dm_arena_alloc, with room for a destructor record.
+ *
+ * The record is bumped right before the object, so objects without a
+ * destructor pay nothing. It stays unused until dm_arena_set_dtor, so a
+ * constructor that fails leaves nothing to run on reset.
+ */
+void *dm_arena_alloc_slot(Arena *arena, size_t size, size_t align)
+{
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+    // the record sits directly below the aligned object
+    size_t lead = align_addr(sizeof(ArenaDtor), align);
+    char *mem = arena_bump(arena, lead + size, align);
+    return mem ? mem + lead : NULL;
+}
+
+/**
+ * @brief make `fn` run on `obj` at reset, `obj` is from dm_arena_alloc_slot.
+ *
+ * Destructors run newest first.
+ */
+void dm_arena_set_dtor(Arena *arena, void *obj, void (*fn)(void *))
+{
+    ArenaDtor *dtor = (ArenaDtor *)obj - 1;
+    dtor->fn = fn;
+    dtor->prev = arena->dtors;
+    arena->dtors = dtor;
+}
+
+/**
+ * @brief like dm_arena_alloc, and `fn` runs on the object at reset.
+ */
+void *dm_arena_alloc_dtor(Arena *arena, size_t size, size_t align, void (*fn)(void *))
+{
+    void *obj = dm_arena_alloc_slot(arena, size, align);
+    if (obj)
+        dm_arena_set_dtor(arena, obj, fn);
+    return obj;
+}
+
+/**
+ * @brief runs destructors and drops every allocation.
+ *
+ * The newest chunk is kept so a reused arena does not go back to mmalloc.
+ */
+void dm_arena_reset(Arena *arena)
+{
+    for (ArenaDtor *d = arena->dtors; d; d = d->prev)
+        d->fn(d + 1);
+    arena->dtors = NULL;
+
+    ArenaChunk *keep = arena->chunks;
+    if (!keep)
+        return;
+    ArenaChunk *curr = keep->next;
+    while (curr)
+    {
+        ArenaChunk *next = curr->next;
+        mfree(curr);
+        curr = next;
+    }
+    keep->next = NULL;
+    keep->used = 0;
+}
+
+/**
+ * @brief resets the arena and gives all of its memory back
+ */
+void dm_arena_destroy(Arena *arena)
+{
+    if (!arena)
+        return;
+    dm_arena_reset(arena);
+    mfree(arena->chunks);
+    mfree(arena);
+}
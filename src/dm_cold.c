@@ -0,0 +1,606 @@
+#define _GNU_SOURCE // mremap, pipe2
+#include "dm_cold.h"
+#include "dm_alloc.h"
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#ifndef MREMAP_DONTUNMAP
+#define MREMAP_DONTUNMAP 4
+#endif
+
+// a page is only kept compressed if it shrinks to this fraction or less
+#define COLD_KEEP_NUM 3
+#define COLD_KEEP_DEN 4
+#define COLD_DEFAULT_ALIGN 16
+
+// LZ4-style block: token (literal and match length nibbles), literals,
+// 16-bit match offset, with 255-byte length extensions
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+static inline size_t round_up(size_t n, size_t align)
+{
+    return (n + (align - 1)) & ~(align - 1);
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint32_t lz_read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * @brief write the 255-byte extension of a length that did not fit its nibble
+ */
+static unsigned char *lz_put_len(unsigned char *op, size_t len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/**
+ * @brief compress `n` bytes of `src` into at most `cap` bytes of `dst`
+ *
+ * @return compressed size, 0 if it would not fit in `cap`
+ */
+static size_t lz_compress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap)
+{
+    uint32_t table[1 << LZ_HASH_BITS] = {0}; // position + 1 of the last 4 bytes per hash
+    const unsigned char *ip = src, *anchor = src, *end = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+
+    while (ip + LZ_MIN_MATCH <= end)
+    {
+        uint32_t v = lz_read32(ip), h = lz_hash(v);
+        const unsigned char *match = table[h] ? src + table[h] - 1 : NULL;
+        table[h] = (uint32_t)(ip - src) + 1;
+        if (!match || ip - match > LZ_MAX_OFFSET || lz_read32(match) != v)
+        {
+            ip++;
+            continue;
+        }
+        size_t mlen = LZ_MIN_MATCH;
+        while (ip + mlen < end && ip[mlen] == match[mlen])
+            mlen++;
+
+        size_t lit = (size_t)(ip - anchor), m = mlen - LZ_MIN_MATCH;
+        if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + m / 255 + 1)
+            return 0;
+        unsigned char *token = op++;
+        *token = (unsigned char)((lit < 15 ? lit : 15) << 4 | (m < 15 ? m : 15));
+        if (lit >= 15)
+            op = lz_put_len(op, lit - 15);
+        memcpy(op, anchor, lit);
+        op += lit;
+        size_t off = (size_t)(ip - match);
+        *op++ = (unsigned char)off;
+        *op++ = (unsigned char)(off >> 8);
+        if (m >= 15)
+            op = lz_put_len(op, m - 15);
+        ip += mlen;
+        anchor = ip;
+    }
+
+    // the last sequence is literals only
+    size_t lit = (size_t)(end - anchor);
+    if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit)
+        return 0;
+    *op++ = (unsigned char)((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15)
+        op = lz_put_len(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return (size_t)(op - dst);
+}
+
+/**
+ * @brief read a length extension, -1 if the input ends inside it
+ */
+static int lz_get_len(const unsigned char **ip, const unsigned char *iend, size_t *len)
+{
+    unsigned char b;
+    do
+    {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/**
+ * @brief expand `len` bytes of lz_compress output into exactly `n` bytes
+ *
+ * @return 0 on success, -1 if the input is malformed
+ */
+static int lz_decompress(const unsigned char *src, size_t len, unsigned char *dst, size_t n)
+{
+    const unsigned char *ip = src, *iend = src + len;
+    unsigned char *op = dst, *oend = dst + n;
+
+    while (ip < iend)
+    {
+        unsigned token = *ip++;
+        size_t lit = token >> 4, mlen = token & 15;
+        if (lit == 15 && lz_get_len(&ip, iend, &lit) != 0)
+            return -1;
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend)
+            break; // the last sequence has no match
+        if (iend - ip < 2)
+            return -1;
+        size_t off = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (mlen == 15 && lz_get_len(&ip, iend, &mlen) != 0)
+            return -1;
+        mlen += LZ_MIN_MATCH;
+        if (off == 0 || off > (size_t)(op - dst) || mlen > (size_t)(oend - op))
+            return -1;
+        const unsigned char *match = op - off;
+        if (off >= mlen)
+            memcpy(op, match, mlen);
+        else
+        {
+            for (size_t i = 0; i < mlen; i++)
+                op[i] = match[i]; // overlapping run
+        }
+        op += mlen;
+    }
+    return op == oend ? 0 : -1;
+}
+
+/**
+ * @brief worst case lz_compress output for `n` bytes, all literals
+ */
+static inline size_t pack_bound(size_t n)
+{
+    return 1 + n / 255 + 1 + n;
+}
+
+static int all_zero(const unsigned char *p, size_t n)
+{
+    for (size_t i = 0; i < n; i += sizeof(uint64_t))
+    {
+        uint64_t v;
+        memcpy(&v, p + i, sizeof(v));
+        if (v)
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief map `src` at the arena page `at`, waking threads waiting on it
+ *
+ * @return 0 on success or if another fault mapped the page first
+ */
+static int place_page(ColdArena *arena, char *at, const void *src)
+{
+    struct uffdio_copy copy = {(uintptr_t)at, (uintptr_t)src, arena->page, 0, 0};
+    if (ioctl(arena->uffd, UFFDIO_COPY, &copy) == 0)
+        return 0;
+    if (errno != EEXIST)
+        return -1;
+    struct uffdio_range range = {(uintptr_t)at, arena->page};
+    ioctl(arena->uffd, UFFDIO_WAKE, &range);
+    return 0;
+}
+
+/**
+ * @brief resolve a missing page fault at `address`
+ *
+ * Released pages are decompressed back, untouched ones map the zero
+ * page. A page another fault already resolved only needs its waiters
+ * woken.
+ */
+static void cold_fault(ColdArena *arena, uintptr_t address)
+{
+    uint64_t start = now_ns();
+    size_t i = (address - (uintptr_t)arena->base) / arena->page;
+    char *at = arena->base + i * arena->page;
+    ColdPage *p = &arena->pages[i];
+
+    pthread_mutex_lock(&arena->lock);
+    int state = p->state;
+    if (state == DM_COLD_PACKED)
+    {
+        // a copy that does not expand cleanly is a bug, never hand out garbage
+        if (lz_decompress(p->data, p->len, (unsigned char *)arena->buffer, arena->page) != 0)
+            memset(arena->buffer, 0, arena->page);
+        if (place_page(arena, at, arena->buffer) == 0)
+        {
+            mfree(p->data);
+            p->data = NULL;
+            arena->packed_pages--;
+            arena->packed_bytes -= p->len;
+            p->state = DM_COLD_RESIDENT;
+        }
+    }
+    else if (state == DM_COLD_ZERO || state == DM_COLD_EMPTY)
+    {
+        struct uffdio_zeropage zero = {{(uintptr_t)at, arena->page}, 0, 0};
+        int rc = ioctl(arena->uffd, UFFDIO_ZEROPAGE, &zero);
+        if (rc != 0 && errno == EEXIST)
+            rc = ioctl(arena->uffd, UFFDIO_WAKE, &zero.range);
+        if (rc == 0)
+        {
+            if (state == DM_COLD_ZERO)
+                arena->zero_pages--;
+            p->state = DM_COLD_RESIDENT;
+        }
+    }
+    else
+    {
+        struct uffdio_range range = {(uintptr_t)at, arena->page};
+        ioctl(arena->uffd, UFFDIO_WAKE, &range);
+    }
+
+    if (state != DM_COLD_RESIDENT && p->state == DM_COLD_RESIDENT)
+    {
+        p->touched = arena->sweeps;
+        arena->resident_pages++;
+        if (state == DM_COLD_EMPTY)
+            arena->first_touches++;
+        else
+        {
+            arena->faults++;
+            arena->fault_ns += now_ns() - start;
+        }
+    }
+    pthread_mutex_unlock(&arena->lock);
+}
+
+static void *cold_handler(void *arg)
+{
+    ColdArena *arena = arg;
+    struct pollfd fds[2] = {{arena->uffd, POLLIN, 0}, {arena->wake[0], POLLIN, 0}};
+    for (;;)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[1].revents)
+            break; // dm_cold_destroy
+        struct uffd_msg msg;
+        if (read(arena->uffd, &msg, sizeof(msg)) != (ssize_t)sizeof(msg))
+            continue; // nothing queued after all
+        if (msg.event == UFFD_EVENT_PAGEFAULT)
+            cold_fault(arena, (uintptr_t)msg.arg.pagefault.address);
+    }
+    return NULL;
+}
+
+/**
+ * @brief open a userfaultfd, for kernel accesses too where permitted
+ */
+static int open_uffd()
+{
+    int fd = (int)syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+#ifdef UFFD_USER_MODE_ONLY
+    if (fd < 0 && errno == EPERM)
+        fd = (int)syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+#endif
+    if (fd < 0)
+        return -1;
+    struct uffdio_api api = {UFFD_API, 0, 0};
+    if (ioctl(fd, UFFDIO_API, &api) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief creates a cold arena of `size` bytes of address space.
+ *
+ * Pages are only backed once touched. dm_cold_sweep compresses pages
+ * that have sat idle into the main heap and releases them; the first
+ * access to a released page faults, and a handler thread decompresses it
+ * in place through userfaultfd, so callers see ordinary memory.
+ *
+ * Where unprivileged userfaultfd is limited to user faults, a system call
+ * reading or writing a released page fails with EFAULT: touch such
+ * buffers before passing them to the kernel. A forked child must not use
+ * the arena.
+ *
+ * @return the arena, or NULL with errno set (ENOSYS or EPERM where
+ * userfaultfd is unavailable)
+ */
+ColdArena *dm_cold_create(size_t size)
+{
+    int err;
+    ColdArena *arena = mcalloc(1, sizeof(ColdArena));
+    if (!arena)
+        return NULL;
+    arena->page = (size_t)sysconf(_SC_PAGESIZE);
+    arena->size = round_up(size ? size : arena->page, arena->page);
+    arena->uffd = -1;
+    arena->wake[0] = arena->wake[1] = -1;
+    arena->base = MAP_FAILED;
+    arena->scratch = MAP_FAILED;
+    arena->buffer = MAP_FAILED;
+    pthread_mutex_init(&arena->lock, NULL);
+
+    arena->pages = mcalloc(arena->size / arena->page, sizeof(ColdPage));
+    arena->packing = mmalloc(pack_bound(arena->page));
+    arena->base = mmap(NULL, arena->size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    arena->scratch = mmap(NULL, DM_COLD_RUN * arena->page, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    arena->buffer = mmap(NULL, arena->page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!arena->pages || !arena->packing || arena->base == MAP_FAILED || arena->scratch == MAP_FAILED ||
+        arena->buffer == MAP_FAILED)
+        goto fail;
+
+    if ((arena->uffd = open_uffd()) < 0)
+        goto fail;
+    struct uffdio_register reg = {{(uintptr_t)arena->base, arena->size}, UFFDIO_REGISTER_MODE_MISSING, 0};
+    if (ioctl(arena->uffd, UFFDIO_REGISTER, &reg) != 0)
+        goto fail;
+    if (pipe2(arena->wake, O_CLOEXEC) != 0)
+        goto fail;
+    arena->created_ns = now_ns();
+    err = pthread_create(&arena->handler, NULL, cold_handler, arena);
+    if (err == 0)
+        return arena;
+    errno = err;
+
+fail:
+    err = errno;
+    if (arena->wake[0] >= 0)
+        close(arena->wake[0]);
+    if (arena->wake[1] >= 0)
+        close(arena->wake[1]);
+    if (arena->uffd >= 0)
+        close(arena->uffd);
+    if (arena->base != MAP_FAILED)
+        munmap(arena->base, arena->size);
+    if (arena->scratch != MAP_FAILED)
+        munmap(arena->scratch, DM_COLD_RUN * arena->page);
+    if (arena->buffer != MAP_FAILED)
+        munmap(arena->buffer, arena->page);
+    mfree(arena->packing);
+    mfree(arena->pages);
+    pthread_mutex_destroy(&arena->lock);
+    mfree(arena);
+    errno = err;
+    return NULL;
+}
+
+/**
+ * @brief `size` bytes aligned to `align` (0 for 16), bumped from the arena.
+ *
+ * Blocks are not freed one by one, dm_cold_reset drops them all.
+ *
+ * @return NULL with errno ENOMEM when the arena is full, EINVAL if
+ * `align` is not a power of two
+ */
+void *dm_cold_alloc(ColdArena *arena, size_t size, size_t align)
+{
+    if (align == 0)
+        align = COLD_DEFAULT_ALIGN;
+    if (align & (align - 1))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    void *ptr = NULL;
+    pthread_mutex_lock(&arena->lock);
+    size_t at = round_up(arena->used, align);
+    if (at <= arena->size && size <= arena->size - at)
+    {
+        ptr = arena->base + at;
+        arena->used = at + size;
+    }
+    pthread_mutex_unlock(&arena->lock);
+    if (!ptr)
+        errno = ENOMEM;
+    return ptr;
+}
+
+static inline int is_cold(ColdArena *arena, size_t i, unsigned idle_sweeps)
+{
+    ColdPage *p = &arena->pages[i];
+    return p->state == DM_COLD_RESIDENT && arena->sweeps - p->touched >= idle_sweeps;
+}
+
+/**
+ * @brief compress page `i`, already moved out to `src`
+ *
+ * @return 1 if the page stays released, 0 if it was put back
+ */
+static int pack_page(ColdArena *arena, size_t i, const unsigned char *src)
+{
+    ColdPage *p = &arena->pages[i];
+    if (all_zero(src, arena->page))
+    {
+        p->state = DM_COLD_ZERO;
+        arena->zero_pages++;
+    }
+    else
+    {
+        size_t cap = arena->page * COLD_KEEP_NUM / COLD_KEEP_DEN;
+        size_t len = lz_compress(src, arena->page, arena->packing, cap);
+        void *data = len ? mmalloc(len) : NULL;
+        if (!data)
+        {
+            // not worth it (or no memory for the copy), map the page back
+            if (place_page(arena, arena->base + i * arena->page, src) == 0)
+            {
+                arena->incompressible++;
+                p->touched = arena->sweeps;
+                return 0;
+            }
+            // the page is gone from the arena, keep it whatever it costs
+            len = lz_compress(src, arena->page, arena->packing, pack_bound(arena->page));
+            data = mmalloc(len);
+            if (!data)
+            {
+                // nothing left to hold it, it will read as zeros
+                p->state = DM_COLD_ZERO;
+                arena->zero_pages++;
+                arena->resident_pages--;
+                return 1;
+            }
+        }
+        memcpy(data, arena->packing, len);
+        p->data = data;
+        p->len = (uint32_t)len;
+        p->state = DM_COLD_PACKED;
+        arena->packed_pages++;
+        arena->packed_bytes += len;
+    }
+    arena->resident_pages--;
+    arena->compressions++;
+    return 1;
+}
+
+/**
+ * @brief compress and release pages idle for `idle_sweeps` sweeps.
+ *
+ * A page is idle once `idle_sweeps` sweeps have passed since it was
+ * last faulted in (0 takes every resident page). Accesses to resident
+ * pages are not seen, so a page in steady use goes through one compress
+ * and fault cycle every `idle_sweeps` sweeps; watch faults_per_sec in
+ * dm_cold_stats to tune the period. Each run of cold pages is moved out
+ * of the arena with one mremap, so a thread touching it meanwhile waits
+ * in the fault handler instead of losing a write. Pages that do not
+ * shrink to 3/4 of a page are mapped back and retried after the next
+ * idle period.
+ *
+ * @return number of pages released
+ */
+size_t dm_cold_sweep(ColdArena *arena, unsigned idle_sweeps)
+{
+    size_t released = 0;
+    pthread_mutex_lock(&arena->lock);
+    size_t n = round_up(arena->used, arena->page) / arena->page;
+    for (size_t i = 0; i < n;)
+    {
+        if (!is_cold(arena, i, idle_sweeps))
+        {
+            i++;
+            continue;
+        }
+        size_t run = 1;
+        while (run < DM_COLD_RUN && i + run < n && is_cold(arena, i + run, idle_sweeps))
+            run++;
+        // the arena pages become missing, the scratch range gets their contents
+        if (mremap(arena->base + i * arena->page, run * arena->page, run * arena->page,
+                   MREMAP_MAYMOVE | MREMAP_FIXED | MREMAP_DONTUNMAP, arena->scratch) == MAP_FAILED)
+            break;
+        for (size_t j = 0; j < run; j++)
+            released += (size_t)pack_page(arena, i + j, (unsigned char *)arena->scratch + j * arena->page);
+        madvise(arena->scratch, run * arena->page, MADV_DONTNEED);
+        i += run;
+    }
+    arena->sweeps++;
+    pthread_mutex_unlock(&arena->lock);
+    return released;
+}
+
+/**
+ * @brief snapshot of the arena's counters, with ratio and rates derived.
+ */
+void dm_cold_stats(ColdArena *arena, ColdStats *out)
+{
+    pthread_mutex_lock(&arena->lock);
+    *out = (ColdStats){0};
+    out->resident_pages = arena->resident_pages;
+    out->packed_pages = arena->packed_pages;
+    out->zero_pages = arena->zero_pages;
+    out->packed_bytes = arena->packed_bytes;
+    if (arena->packed_bytes)
+        out->ratio = (double)(arena->packed_pages * arena->page) / (double)arena->packed_bytes;
+    out->saved_bytes = (arena->packed_pages + arena->zero_pages) * arena->page - arena->packed_bytes;
+    out->sweeps = arena->sweeps;
+    out->compressions = arena->compressions;
+    out->incompressible = arena->incompressible;
+    out->faults = arena->faults;
+    out->first_touches = arena->first_touches;
+    double secs = (double)(now_ns() - arena->created_ns) / 1e9;
+    out->faults_per_sec = secs > 0 ? (double)arena->faults / secs : 0;
+    if (arena->faults)
+        out->mean_fault_ns = (double)arena->fault_ns / (double)arena->faults;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+static void drop_copies(ColdArena *arena)
+{
+    for (size_t i = 0; i < arena->size / arena->page; i++)
+    {
+        mfree(arena->pages[i].data);
+        arena->pages[i] = (ColdPage){0};
+    }
+}
+
+/**
+ * @brief drop every block and page, the arena reads as zeros again.
+ *
+ * Counters of past sweeps and faults are kept.
+ */
+void dm_cold_reset(ColdArena *arena)
+{
+    pthread_mutex_lock(&arena->lock);
+    madvise(arena->base, arena->size, MADV_DONTNEED);
+    drop_copies(arena);
+    arena->used = 0;
+    arena->resident_pages = 0;
+    arena->packed_pages = 0;
+    arena->zero_pages = 0;
+    arena->packed_bytes = 0;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/**
+ * @brief stop the handler and unmap the arena, all its memory becomes invalid
+ */
+void dm_cold_destroy(ColdArena *arena)
+{
+    if (!arena)
+        return;
+    char stop = 1;
+    if (write(arena->wake[1], &stop, 1) == 1)
+        pthread_join(arena->handler, NULL);
+    close(arena->wake[0]);
+    close(arena->wake[1]);
+    close(arena->uffd);
+    munmap(arena->base, arena->size);
+    munmap(arena->scratch, DM_COLD_RUN * arena->page);
+    munmap(arena->buffer, arena->page);
+    drop_copies(arena);
+    mfree(arena->packing);
+    mfree(arena->pages);
+    pthread_mutex_destroy(&arena->lock);
+    mfree(arena);
+}
@@ -0,0 +1,374 @@
+#include "dm_intern.h"
+#include "dm_alloc.h"
+
+#define INTERN_DEFAULT_CHUNK 65536
+#define INTERN_MIN_INDEX 64
+#define INTERN_TOMB ((InternEntry *)1)
+#define INTERN_MAX_LOCAL ((uint32_t)1 << (32 - DM_INTERN_SHARD_BITS))
+
+/**
+ * @brief 64 bit multiply-rotate hash, 8 bytes at a time
+ */
+static uint64_t intern_hash(const unsigned char *p, size_t len)
+{
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ len;
+    while (len >= 8)
+    {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+        p += 8;
+        len -= 8;
+    }
+    uint64_t w = 0;
+    memcpy(&w, p, len);
+    h = (h ^ w) * 0xC4CEB9FE1A85EC53ull;
+    return h ^ (h >> 29);
+}
+
+static inline InternEntry *entry_of(const char *str)
+{
+    return (InternEntry *)str - 1;
+}
+
+/**
+ * @brief chunk holding `entry`, chunks of refcounting pools are aligned
+ * to their size
+ */
+static inline InternChunk *chunk_of(InternPool *pool, InternEntry *entry)
+{
+    return (InternChunk *)((uintptr_t)entry & ~(uintptr_t)(pool->chunk_size - 1));
+}
+
+/**
+ * @brief segment slot of shard-local id `local`
+ */
+static InternEntry **id_slot(InternShard *shard, uint32_t local, int create)
+{
+    uint64_t i = (uint64_t)local + 256;
+    int k = 63 - __builtin_clzll(i) - 8;
+    InternEntry **seg = __atomic_load_n(&shard->segments[k], __ATOMIC_ACQUIRE);
+    if (!seg && create)
+    {
+        seg = mcalloc((size_t)256 << k, sizeof(InternEntry *));
+        if (!seg)
+            return NULL;
+        __atomic_store_n(&shard->segments[k], seg, __ATOMIC_RELEASE);
+    }
+    return seg ? &seg[i - ((uint64_t)256 << k)] : NULL;
+}
+
+/**
+ * @brief a shard-local id for a new entry, reusing released ones first
+ *
+ * @return 0 on success, -1 if ids or memory ran out
+ */
+static int take_id(InternShard *shard, uint32_t *local)
+{
+    if (shard->free_ids)
+    {
+        *local = shard->free_ids - 1;
+        shard->free_ids = (uint32_t)((uintptr_t)*id_slot(shard, *local, 0) >> 1);
+        return 0;
+    }
+    if (shard->next_id == INTERN_MAX_LOCAL || !id_slot(shard, shard->next_id, 1))
+        return -1;
+    *local = shard->next_id++;
+    return 0;
+}
+
+/**
+ * @brief rebuild the index with room for twice the live entries
+ *
+ * @return 0 on success, -1 if out of memory
+ */
+static int index_grow(InternShard *shard, size_t live)
+{
+    size_t cap = INTERN_MIN_INDEX;
+    while (cap < live * 2)
+        cap *= 2;
+    InternEntry **index = mcalloc(cap, sizeof(InternEntry *));
+    if (!index)
+        return -1;
+    for (size_t i = 0; i < shard->cap; i++)
+    {
+        InternEntry *e = shard->index[i];
+        if (!e || e == INTERN_TOMB)
+            continue;
+        size_t j = e->hash & (cap - 1);
+        while (index[j])
+            j = (j + 1) & (cap - 1);
+        index[j] = e;
+    }
+    mfree(shard->index);
+    shard->index = index;
+    shard->cap = cap;
+    shard->count = live;
+    return 0;
+}
+
+/**
+ * @brief room for an entry of `len` bytes from the shard's current chunk
+ */
+static InternEntry *entry_bump(InternPool *pool, InternShard *shard, size_t len)
+{
+    size_t need = (sizeof(InternEntry) + len + 1 + 3) & ~(size_t)3;
+    InternChunk *chunk = shard->chunks;
+    if (!chunk || chunk->used + need > chunk->size)
+    {
+        size_t csize = pool->chunk_size - sizeof(InternChunk);
+        if (need > csize)
+            csize = need; // a string of its own
+        if (pool->flags & DM_INTERN_REFCOUNT)
+            chunk = dm_aligned_alloc(pool->chunk_size, sizeof(InternChunk) + csize);
+        else
+            chunk = mmalloc(sizeof(InternChunk) + csize);
+        if (!chunk)
+            return NULL;
+        chunk->size = csize;
+        chunk->used = chunk->live = 0;
+        chunk->prev = NULL;
+        chunk->next = shard->chunks;
+        if (shard->chunks)
+            shard->chunks->prev = chunk;
+        shard->chunks = chunk;
+    }
+    InternEntry *entry = (InternEntry *)((char *)(chunk + 1) + chunk->used);
+    chunk->used += need;
+    chunk->live++;
+    return entry;
+}
+
+/**
+ * @brief creates an empty pool.
+ *
+ * @param chunk_size bytes per chunk, rounded up to a power of two, 0 for 64 KiB
+ * @param flags DM_INTERN_REFCOUNT to free strings by reference count
+ *
+ * @return the pool, or NULL with errno ENOMEM
+ */
+InternPool *dm_intern_create(size_t chunk_size, int flags)
+{
+    size_t size = 256;
+    while (size < (chunk_size ? chunk_size : INTERN_DEFAULT_CHUNK))
+        size *= 2;
+    InternPool *pool = mcalloc(1, sizeof(InternPool));
+    if (!pool)
+        return NULL;
+    pool->chunk_size = size;
+    pool->flags = flags;
+    for (int s = 0; s < DM_INTERN_SHARDS; s++)
+        pthread_mutex_init(&pool->shards[s].lock, NULL);
+    return pool;
+}
+
+/**
+ * @brief the one stored copy of `len` bytes at `bytes`.
+ *
+ * Equal byte strings get the same pointer and id, which stay valid
+ * until released or the pool is cleared. The copy is NUL terminated and
+ * must not be written. Shards have their own locks, so threads interning
+ * different strings rarely wait for each other. In DM_INTERN_REFCOUNT
+ * pools every call takes a reference.
+ *
+ * @param id receives the 32 bit id, may be NULL
+ *
+ * @return the stored string, or NULL with errno ENOMEM
+ */
+const char *dm_intern(InternPool *pool, const void *bytes, size_t len, uint32_t *id)
+{
+    if (len >= UINT32_MAX)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    uint64_t h = intern_hash(bytes, len);
+    InternShard *shard = &pool->shards[h >> (64 - DM_INTERN_SHARD_BITS)];
+    uint32_t hash = (uint32_t)h;
+    InternEntry *found = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    size_t slot = shard->cap, i = hash & (shard->cap - 1);
+    for (size_t n = 0; n < shard->cap; n++, i = (i + 1) & (shard->cap - 1))
+    {
+        InternEntry *e = shard->index[i];
+        if (!e)
+        {
+            if (slot == shard->cap)
+                slot = i;
+            break;
+        }
+        if (e == INTERN_TOMB)
+        {
+            if (slot == shard->cap)
+                slot = i; // reuse the first tombstone
+            continue;
+        }
+        if (e->hash == hash && e->len == len && memcmp(e + 1, bytes, len) == 0)
+        {
+            found = e;
+            break;
+        }
+    }
+
+    if (found)
+        __atomic_fetch_add(&pool->hits, 1, __ATOMIC_RELAXED);
+    else
+    {
+        uint32_t local;
+        if ((shard->count + 1) * 10 > shard->cap * 7)
+        {
+            size_t live = 0;
+            for (size_t k = 0; k < shard->cap; k++)
+                live += shard->index[k] && shard->index[k] != INTERN_TOMB;
+            if (index_grow(shard, live + 1) != 0)
+                goto fail;
+            slot = hash & (shard->cap - 1);
+            while (shard->index[slot])
+                slot = (slot + 1) & (shard->cap - 1);
+        }
+        if (take_id(shard, &local) != 0)
+            goto fail;
+        found = entry_bump(pool, shard, len);
+        if (!found)
+        {
+            // give the id back
+            *id_slot(shard, local, 0) = (InternEntry *)(((uintptr_t)shard->free_ids << 1) | 1);
+            shard->free_ids = local + 1;
+            goto fail;
+        }
+        found->hash = hash;
+        found->len = (uint32_t)len;
+        found->refs = 0;
+        found->id = (local << DM_INTERN_SHARD_BITS) | (uint32_t)(shard - pool->shards);
+        memcpy(found + 1, bytes, len);
+        ((char *)(found + 1))[len] = '\0';
+        if (!shard->index[slot])
+            shard->count++; // a reused tombstone was counted already
+        shard->index[slot] = found;
+        __atomic_store_n(id_slot(shard, local, 0), found, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&pool->strings, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&pool->bytes, len, __ATOMIC_RELAXED);
+    }
+    if (pool->flags & DM_INTERN_REFCOUNT)
+        found->refs++;
+    pthread_mutex_unlock(&shard->lock);
+    if (id)
+        *id = found->id;
+    return (const char *)(found + 1);
+
+fail:
+    pthread_mutex_unlock(&shard->lock);
+    errno = ENOMEM;
+    return NULL;
+}
+
+/**
+ * @brief string of `id`, without taking a lock
+ *
+ * @return NULL if the id is unknown or was released
+ */
+const char *dm_intern_str(InternPool *pool, uint32_t id)
+{
+    InternShard *shard = &pool->shards[id & (DM_INTERN_SHARDS - 1)];
+    InternEntry **slot = id_slot(shard, id >> DM_INTERN_SHARD_BITS, 0);
+    InternEntry *e = slot ? __atomic_load_n(slot, __ATOMIC_ACQUIRE) : NULL;
+    if (!e || ((uintptr_t)e & 1))
+        return NULL;
+    return (const char *)(e + 1);
+}
+
+/**
+ * @brief length of an interned string, from its header
+ */
+size_t dm_intern_len(const char *str)
+{
+    return entry_of(str)->len;
+}
+
+uint32_t dm_intern_id(const char *str)
+{
+    return entry_of(str)->id;
+}
+
+/**
+ * @brief drop a reference taken by dm_intern in a DM_INTERN_REFCOUNT pool.
+ *
+ * The last one removes the string; its id may be handed out again and a
+ * chunk whose strings are all gone is freed.
+ */
+void dm_intern_release(InternPool *pool, uint32_t id)
+{
+    if (!(pool->flags & DM_INTERN_REFCOUNT))
+        return;
+    InternShard *shard = &pool->shards[id & (DM_INTERN_SHARDS - 1)];
+    uint32_t local = id >> DM_INTERN_SHARD_BITS;
+
+    pthread_mutex_lock(&shard->lock);
+    InternEntry **slot = id_slot(shard, local, 0);
+    InternEntry *e = slot ? *slot : NULL;
+    if (!e || ((uintptr_t)e & 1) || --e->refs > 0)
+    {
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    size_t i = e->hash & (shard->cap - 1);
+    while (shard->index[i] != e)
+        i = (i + 1) & (shard->cap - 1);
+    shard->index[i] = INTERN_TOMB;
+    __atomic_store_n(slot, (InternEntry *)(((uintptr_t)shard->free_ids << 1) | 1), __ATOMIC_RELEASE);
+    shard->free_ids = local + 1;
+    __atomic_fetch_sub(&pool->strings, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&pool->bytes, e->len, __ATOMIC_RELAXED);
+
+    InternChunk *chunk = chunk_of(pool, e);
+    if (--chunk->live == 0 && chunk != shard->chunks)
+    {
+        chunk->prev->next = chunk->next; // not the head, so prev is set
+        if (chunk->next)
+            chunk->next->prev = chunk->prev;
+        mfree(chunk);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * @brief release every string at once, all pointers and ids become invalid
+ */
+void dm_intern_clear(InternPool *pool)
+{
+    for (int s = 0; s < DM_INTERN_SHARDS; s++)
+    {
+        InternShard *shard = &pool->shards[s];
+        pthread_mutex_lock(&shard->lock);
+        while (shard->chunks)
+        {
+            InternChunk *next = shard->chunks->next;
+            mfree(shard->chunks);
+            shard->chunks = next;
+        }
+        for (int k = 0; k < DM_INTERN_SEGMENTS; k++)
+        {
+            mfree(shard->segments[k]);
+            shard->segments[k] = NULL;
+        }
+        mfree(shard->index);
+        shard->index = NULL;
+        shard->cap = shard->count = 0;
+        shard->next_id = shard->free_ids = 0;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    pool->strings = pool->bytes = pool->hits = 0;
+}
+
+void dm_intern_destroy(InternPool *pool)
+{
+    if (!pool)
+        return;
+    dm_intern_clear(pool);
+    for (int s = 0; s < DM_INTERN_SHARDS; s++)
+        pthread_mutex_destroy(&pool->shards[s].lock);
+    mfree(pool);
+}
@@ -0,0 +1,324 @@
+#define _GNU_SOURCE // memfd_create
+#include "dm_jit.h"
+#include "dm_alloc.h"
+#include <sys/mman.h>
+
+// regions are cut into runs, each run holds blocks of one size class
+#define JIT_RUN 16384
+#define JIT_MIN_CLASS 32
+#define JIT_DEFAULT_REGION (1 << 20)
+
+static inline size_t round_up(size_t n, size_t align)
+{
+    return (n + (align - 1)) & ~(align - 1);
+}
+
+/**
+ * @brief smallest class holding `size` bytes
+ */
+static int jit_class(size_t size)
+{
+    int c = 0;
+    while ((size_t)JIT_MIN_CLASS << c < size)
+        c++;
+    return c;
+}
+
+/**
+ * @brief map `size` bytes of a fresh memfd twice, writable and executable
+ *
+ * @return the region, or NULL if the system refuses executable mappings
+ */
+static JitRegion *region_create(size_t size, int small)
+{
+    JitRegion *region = mmalloc(sizeof(JitRegion));
+    if (!region)
+        return NULL;
+    region->size = size;
+    region->runs = 0;
+    region->run_class = NULL;
+    if (small && !(region->run_class = mmalloc(size / JIT_RUN)))
+        goto fail;
+
+    int fd = memfd_create("dm_jit", MFD_CLOEXEC);
+    if (fd < 0)
+        goto fail;
+    region->rw = MAP_FAILED;
+    region->rx = MAP_FAILED;
+    if (ftruncate(fd, (off_t)size) == 0)
+    {
+        region->rw = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        region->rx = mmap(NULL, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+    }
+    close(fd); // the mappings keep the pages alive
+    if (region->rw != MAP_FAILED && region->rx != MAP_FAILED)
+        return region;
+    if (region->rw != MAP_FAILED)
+        munmap(region->rw, size);
+    if (region->rx != MAP_FAILED)
+        munmap(region->rx, size);
+
+fail:
+    mfree(region->run_class);
+    mfree(region);
+    return NULL;
+}
+
+static void region_destroy(JitRegion *region)
+{
+    munmap(region->rw, region->size);
+    munmap(region->rx, region->size);
+    mfree(region->run_class);
+    mfree(region);
+}
+
+/**
+ * @brief region whose executable view holds `code`, NULL if none
+ */
+static JitRegion *region_of(JitHeap *heap, void *code)
+{
+    for (JitRegion *r = heap->regions; r; r = r->next)
+    {
+        if ((char *)code >= r->rx && (char *)code < r->rx + r->size)
+            return r;
+    }
+    return NULL;
+}
+
+static inline void *writable(JitRegion *region, void *code)
+{
+    return region->rw + ((char *)code - region->rx);
+}
+
+/**
+ * @brief fill the free list of class `c` from a new run
+ *
+ * @return 0 on success, -1 if no region could be mapped
+ */
+static int carve_run(JitHeap *heap, int c)
+{
+    JitRegion *region = heap->regions;
+    while (region && (!region->run_class || region->runs == region->size / JIT_RUN))
+        region = region->next;
+    if (!region)
+    {
+        region = region_create(heap->region_size, 1);
+        if (!region)
+            return -1;
+        region->next = heap->regions;
+        heap->regions = region;
+        heap->mapped_bytes += region->size;
+    }
+
+    size_t run = region->runs++;
+    size_t block = (size_t)JIT_MIN_CLASS << c;
+    region->run_class[run] = (unsigned char)c;
+    char *base = region->rx + run * JIT_RUN;
+    // link backwards so blocks go out in address order
+    for (size_t off = JIT_RUN; off >= block; off -= block)
+    {
+        char *code = base + off - block;
+        *(void **)writable(region, code) = heap->free_list[c];
+        heap->free_list[c] = code;
+    }
+    return 0;
+}
+
+/**
+ * @brief creates an executable code heap.
+ *
+ * Small functions share regions of `region_size` bytes (0 for 1 MiB),
+ * carved into runs of one size class each; code above DM_JIT_MAX_CLASS
+ * gets a region of its own.
+ *
+ * @return the heap, or NULL with errno ENOMEM
+ */
+JitHeap *dm_jit_create(size_t region_size)
+{
+    JitHeap *heap = mcalloc(1, sizeof(JitHeap));
+    if (!heap)
+        return NULL;
+    heap->region_size = round_up(region_size ? region_size : JIT_DEFAULT_REGION, JIT_RUN);
+    pthread_mutex_init(&heap->lock, NULL);
+    return heap;
+}
+
+/**
+ * @brief room for `size` bytes of code.
+ *
+ * Write the code through `*rw`, then dm_jit_commit and dm_jit_flush
+ * before calling it through the returned address. The two addresses
+ * alias the same memory.
+ *
+ * @return executable address, or NULL if no region could be mapped
+ */
+void *dm_jit_alloc(JitHeap *heap, size_t size, void **rw)
+{
+    if (size == 0)
+        return NULL;
+    void *code = NULL;
+    pthread_mutex_lock(&heap->lock);
+    if (size > DM_JIT_MAX_CLASS)
+    {
+        JitRegion *region = region_create(round_up(size, (size_t)sysconf(_SC_PAGESIZE)), 0);
+        if (region)
+        {
+            region->next = heap->regions;
+            heap->regions = region;
+            heap->mapped_bytes += region->size;
+            heap->inuse_bytes += region->size;
+            code = region->rx;
+            *rw = region->rw;
+        }
+    }
+    else
+    {
+        int c = jit_class(size);
+        if (heap->free_list[c] || carve_run(heap, c) == 0)
+        {
+            code = heap->free_list[c];
+            JitRegion *region = region_of(heap, code);
+            *rw = writable(region, code);
+            heap->free_list[c] = *(void **)*rw;
+            heap->inuse_bytes += (size_t)JIT_MIN_CLASS << c;
+        }
+    }
+    pthread_mutex_unlock(&heap->lock);
+    if (!code)
+        errno = ENOMEM;
+    return code;
+}
+
+/**
+ * @brief writable alias of `code`, to patch code already handed out
+ */
+void *dm_jit_writable(JitHeap *heap, void *code)
+{
+    pthread_mutex_lock(&heap->lock);
+    JitRegion *region = region_of(heap, code);
+    void *rw = region ? writable(region, code) : NULL;
+    pthread_mutex_unlock(&heap->lock);
+    return rw;
+}
+
+static void flush_pending(JitHeap *heap)
+{
+    for (size_t i = 0; i < heap->pending; i++)
+    {
+        __builtin___clear_cache(heap->flush_start[i], heap->flush_end[i]);
+        heap->flushes++;
+    }
+    heap->pending = 0;
+}
+
+/**
+ * @brief drop queued ranges inside `region`, before it is unmapped
+ */
+static void drop_pending(JitHeap *heap, JitRegion *region)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < heap->pending; i++)
+    {
+        if (heap->flush_start[i] >= region->rx && heap->flush_start[i] < region->rx + region->size)
+            continue; // ranges never span regions, see dm_jit_commit
+        heap->flush_start[kept] = heap->flush_start[i];
+        heap->flush_end[kept] = heap->flush_end[i];
+        kept++;
+    }
+    heap->pending = kept;
+}
+
+/**
+ * @brief queue `len` freshly written bytes at `code` for an icache flush.
+ *
+ * A range within a run of the last queued one in the same region is
+ * merged into it, so code emitted close together costs one flush of a
+ * slightly wider range that is still all mapped. A full queue is flushed
+ * right away.
+ */
+void dm_jit_commit(JitHeap *heap, void *code, size_t len)
+{
+    char *start = code, *end = start + len;
+    pthread_mutex_lock(&heap->lock);
+    if (heap->pending)
+    {
+        size_t last = heap->pending - 1;
+        JitRegion *region = region_of(heap, code);
+        if (region && region == region_of(heap, heap->flush_start[last]) &&
+            start <= heap->flush_end[last] + JIT_RUN && end + JIT_RUN >= heap->flush_start[last])
+        {
+            if (start < heap->flush_start[last])
+                heap->flush_start[last] = start;
+            if (end > heap->flush_end[last])
+                heap->flush_end[last] = end;
+            pthread_mutex_unlock(&heap->lock);
+            return;
+        }
+    }
+    if (heap->pending == DM_JIT_FLUSH_QUEUE)
+        flush_pending(heap);
+    heap->flush_start[heap->pending] = start;
+    heap->flush_end[heap->pending] = end;
+    heap->pending++;
+    pthread_mutex_unlock(&heap->lock);
+}
+
+/**
+ * @brief flush the icache for every committed range, call before running
+ * newly committed code
+ */
+void dm_jit_flush(JitHeap *heap)
+{
+    pthread_mutex_lock(&heap->lock);
+    flush_pending(heap);
+    pthread_mutex_unlock(&heap->lock);
+}
+
+/**
+ * @brief give back code from dm_jit_alloc, no thread may still run it
+ */
+void dm_jit_free(JitHeap *heap, void *code)
+{
+    if (!code)
+        return;
+    pthread_mutex_lock(&heap->lock);
+    JitRegion *region = region_of(heap, code);
+    if (region && !region->run_class)
+    {
+        // a large block owns its region
+        JitRegion **link = &heap->regions;
+        while (*link != region)
+            link = &(*link)->next;
+        *link = region->next;
+        heap->mapped_bytes -= region->size;
+        heap->inuse_bytes -= region->size;
+        drop_pending(heap, region); // a later flush must not touch the unmapped range
+        region_destroy(region);
+    }
+    else if (region)
+    {
+        int c = region->run_class[((char *)code - region->rx) / JIT_RUN];
+        *(void **)writable(region, code) = heap->free_list[c];
+        heap->free_list[c] = code;
+        heap->inuse_bytes -= (size_t)JIT_MIN_CLASS << c;
+    }
+    pthread_mutex_unlock(&heap->lock);
+}
+
+/**
+ * @brief unmap every region, all code of the heap becomes invalid
+ */
+void dm_jit_destroy(JitHeap *heap)
+{
+    if (!heap)
+        return;
+    JitRegion *region = heap->regions;
+    while (region)
+    {
+        JitRegion *next = region->next;
+        region_destroy(region);
+        region = next;
+    }
+    pthread_mutex_destroy(&heap->lock);
+    mfree(heap);
+}
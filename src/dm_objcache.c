@@ -0,0 +1,236 @@
+#include "dm_objcache.h"
+#include "dm_alloc.h"
+
+// aim for slabs of about this many bytes
+#define SLAB_TARGET 4096
+#define SLAB_MIN_OBJECTS 8
+
+/**
+ * @brief round `n` up to a multiple of `align` (a power of two)
+ */
+static inline uintptr_t round_up(uintptr_t n, size_t align)
+{
+    return (n + (align - 1)) & ~(uintptr_t)(align - 1);
+}
+
+static inline ObjTag *tag_of(void *obj)
+{
+    return (ObjTag *)obj - 1;
+}
+
+/**
+ * @brief unlink `slab` from the list starting at `*list`
+ */
+static void slab_unlink(ObjSlab **list, ObjSlab *slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+    slab->prev = slab->next = NULL;
+}
+
+static void slab_push(ObjSlab **list, ObjSlab *slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+/**
+ * @brief address of object `i` of `slab`
+ */
+static char *slab_object(ObjCache *cache, ObjSlab *slab, size_t i)
+{
+    uintptr_t base = round_up((uintptr_t)(slab + 1), cache->align);
+    return (char *)base + i * cache->stride + cache->offset;
+}
+
+/**
+ * @brief new slab with every object constructed and free.
+ */
+static ObjSlab *slab_create(ObjCache *cache)
+{
+    ObjSlab *slab = mmalloc(sizeof(ObjSlab) + cache->align + cache->per_slab * cache->stride);
+    if (!slab)
+        return NULL;
+    slab->cache = cache;
+    slab->prev = slab->next = NULL;
+    slab->free_list = NULL;
+    slab->inuse = 0;
+
+    // build the list backwards so objects go out in address order
+    for (size_t i = cache->per_slab; i > 0; i--)
+    {
+        char *obj = slab_object(cache, slab, i - 1);
+        if (cache->ctor)
+            cache->ctor(obj);
+        tag_of(obj)->slab = slab;
+        tag_of(obj)->next_free = slab->free_list;
+        slab->free_list = obj;
+    }
+    cache->slabs++;
+    return slab;
+}
+
+/**
+ * @brief run the destructor on every object and give the slab back.
+ */
+static void slab_destroy(ObjCache *cache, ObjSlab *slab)
+{
+    if (cache->dtor)
+    {
+        for (size_t i = 0; i < cache->per_slab; i++)
+            cache->dtor(slab_object(cache, slab, i));
+    }
+    cache->slabs--;
+    mfree(slab);
+}
+
+/**
+ * @brief creates a cache of constructed objects.
+ *
+ * Objects keep their constructed state across dm_objcache_free and come
+ * back ready to use; `ctor` runs only when a slab is created and `dtor`
+ * only when it is reclaimed.
+ *
+ * @param size object size
+ * @param align power of two alignment, 0 for pointer alignment
+ *
+ * @return the cache, or NULL with errno EINVAL / ENOMEM
+ */
+ObjCache *dm_objcache_create(size_t size, size_t align, void (*ctor)(void *), void (*dtor)(void *))
+{
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+    if (size == 0 || (align & (align - 1)) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ObjCache *cache = mmalloc(sizeof(ObjCache));
+    if (!cache)
+        return NULL;
+    cache->size = size;
+    cache->align = align;
+    cache->offset = round_up(sizeof(ObjTag), align);
+    cache->stride = round_up(cache->offset + size, align);
+    cache->per_slab = SLAB_TARGET / cache->stride;
+    if (cache->per_slab < SLAB_MIN_OBJECTS)
+        cache->per_slab = SLAB_MIN_OBJECTS;
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+    cache->partial = cache->full = NULL;
+    cache->slabs = cache->inuse = 0;
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+/**
+ * @brief a constructed object, creating a slab when none has free objects
+ *
+ * @return the object, or NULL if a slab could not be allocated
+ */
+void *dm_objcache_alloc(ObjCache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    ObjSlab *slab = cache->partial;
+    if (!slab)
+    {
+        slab = slab_create(cache);
+        if (!slab)
+        {
+            pthread_mutex_unlock(&cache->lock);
+            return NULL;
+        }
+        slab_push(&cache->partial, slab);
+    }
+
+    void *obj = slab->free_list;
+    slab->free_list = tag_of(obj)->next_free;
+    slab->inuse++;
+    cache->inuse++;
+    if (!slab->free_list)
+    {
+        slab_unlink(&cache->partial, slab);
+        slab_push(&cache->full, slab);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return obj;
+}
+
+/**
+ * @brief return an object, which must be in its constructed state again
+ */
+void dm_objcache_free(void *obj)
+{
+    if (!obj)
+        return;
+    ObjSlab *slab = tag_of(obj)->slab;
+    ObjCache *cache = slab->cache;
+
+    pthread_mutex_lock(&cache->lock);
+    if (!slab->free_list)
+    {
+        slab_unlink(&cache->full, slab);
+        slab_push(&cache->partial, slab);
+    }
+    tag_of(obj)->next_free = slab->free_list;
+    slab->free_list = obj;
+    slab->inuse--;
+    cache->inuse--;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * @brief destroy and give back every slab with no object in use
+ *
+ * @return number of slabs reclaimed
+ */
+size_t dm_objcache_reap(ObjCache *cache)
+{
+    size_t reaped = 0;
+    pthread_mutex_lock(&cache->lock);
+    ObjSlab *slab = cache->partial;
+    while (slab)
+    {
+        ObjSlab *next = slab->next;
+        if (slab->inuse == 0)
+        {
+            slab_unlink(&cache->partial, slab);
+            slab_destroy(cache, slab);
+            reaped++;
+        }
+        slab = next;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return reaped;
+}
+
+/**
+ * @brief destroy every object and the cache; objects still in use are
+ * destroyed too and must not be touched afterwards
+ */
+void dm_objcache_destroy(ObjCache *cache)
+{
+    if (!cache)
+        return;
+    ObjSlab *lists[2] = {cache->partial, cache->full};
+    for (int l = 0; l < 2; l++)
+    {
+        ObjSlab *slab = lists[l];
+        while (slab)
+        {
+            ObjSlab *next = slab->next;
+            slab_destroy(cache, slab);
+            slab = next;
+        }
+    }
+    pthread_mutex_destroy(&cache->lock);
+    mfree(cache);
+}
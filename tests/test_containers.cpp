@@ -0,0 +1,128 @@
+// Smoke tests of the C++ wrappers in dm_alloc.hpp.
+//
+//   gcc -c -Iinclude src/dm_alloc.c src/dm_arena.c
+//   g++ -Iinclude tests/test_containers.cpp dm_alloc.o dm_arena.o -lpthread
+
+#include "dm_alloc.hpp"
+
+#include <cstdio>
+#include <string>
+
+struct Tracked
+{
+    static int ctors;
+    static int dtors;
+
+    explicit Tracked(bool fail)
+    {
+        if (fail)
+            throw 1;
+        ctors++;
+    }
+    ~Tracked() { dtors++; }
+};
+
+int Tracked::ctors = 0;
+int Tracked::dtors = 0;
+
+void test_arena()
+{
+    std::printf("\n--- DM::ARENA TEST START ---\n");
+
+    dm::arena arena(256);
+    arena.make<Tracked>(false);
+    try
+    {
+        arena.make<Tracked>(true);
+    }
+    catch (int)
+    {
+    }
+    int *plain = arena.make<int>(7);
+    arena.reset();
+    std::printf("constructed %d, destroyed %d, plain value %d\n", Tracked::ctors, Tracked::dtors, *plain);
+
+    std::printf("--- DM::ARENA TEST END ---\n");
+}
+
+void test_vector()
+{
+    std::printf("\n--- DM::VECTOR TEST START ---\n");
+
+    dm::vector<int> v;
+    v.push_back(10);
+    while (v.size() < v.capacity())
+        v.push_back(0);
+    v.push_back(v[0]); // at capacity, the argument lives in the old buffer
+    std::printf("self push_back at capacity: %d\n", v.back());
+
+    dm::vector<std::string> names;
+    names.push_back("first name long enough to live on the heap");
+    while (names.size() < names.capacity())
+        names.push_back("x");
+    names.push_back(names[0]);
+    std::printf("non-trivial self push_back: %d\n", names.back() == names[0]);
+
+    std::size_t n = v.size();
+    v.append(v.data(), n);
+    std::printf("self append: size %zu, copy matches: %d\n", v.size(), v[n] == 10 && v.back() == v[n - 1]);
+
+    std::printf("--- DM::VECTOR TEST END ---\n");
+}
+
+void test_string()
+{
+    std::printf("\n--- DM::STRING TEST START ---\n");
+
+    dm::string s("abc");
+    for (int i = 0; i < 6; i++)
+        s.append(s.c_str(), s.size()); // doubles, moving the buffer on the way
+    bool repeated = s.size() == 3 * 64;
+    for (std::size_t i = 0; i < s.size() && repeated; i++)
+        repeated = s[i] == "abc"[i % 3];
+    std::printf("self append: size %zu, contents repeated: %d\n", s.size(), repeated);
+
+    std::printf("--- DM::STRING TEST END ---\n");
+}
+
+void test_padded_array()
+{
+    std::printf("\n--- DM::PADDED_ARRAY TEST START ---\n");
+
+    dm::padded_array<long> empty(0);
+    dm::padded_array<long> counters(4);
+    counters[3] = 7;
+    std::printf("empty array: size %zu, lines apart: %d\n", empty.size(),
+                reinterpret_cast<char *>(&counters[1]) - reinterpret_cast<char *>(&counters[0]) == DM_CACHE_LINE);
+
+    int too_big = 0;
+    try
+    {
+        dm::allocator<long>().allocate(SIZE_MAX / 2);
+    }
+    catch (const std::bad_alloc &)
+    {
+        too_big++;
+    }
+    dm::vector<long> v;
+    try
+    {
+        v.reserve(SIZE_MAX / 2);
+    }
+    catch (const std::length_error &)
+    {
+        too_big++;
+    }
+    std::printf("overflowing sizes rejected: %d\n", too_big == 2);
+
+    std::printf("--- DM::PADDED_ARRAY TEST END ---\n");
+}
+
+int main()
+{
+    test_arena();
+    test_vector();
+    test_string();
+    test_padded_array();
+    return 0;
+}
@@ -1,5 +1,21 @@
+// Built and run from the repository root, the trace replays read tests/traces:
+//
+//   gcc -Iinclude -Itools src/*.c tools/dm_trace.c tests/test_main.c -o test_main -lpthread
+
 #include "dm_alloc.h"
+#include "dm_arena.h"
+#include "dm_cold.h"
+#include "dm_intern.h"
+#include "dm_jit.h"
+#include "dm_objcache.h"
+#include "dm_trace.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 void test_malloc_free()
 {
@@ -34,9 +50,755 @@ void test_malloc_free()
     printf("--- TEST END ---\n");
 }
 
+void test_extend_tail()
+{
+    printf("\n--- EXTEND TAIL TEST START ---\n");
+
+    char *top = mmalloc(200000);
+    mfree(top); // the free tail now ends at the break
+    HeapStats before, after;
+    dm_get_stats(&before);
+    char *grown = mmalloc(400000);
+    dm_get_stats(&after);
+    printf("grown in place: %d, one sbrk: %d, only the missing bytes mapped: %d, tail reused: %d\n",
+           grown <= top, after.sbrk_calls - before.sbrk_calls == 1,
+           after.mapped_bytes - before.mapped_bytes <= 400000 - 200000,
+           after.reused_bytes - before.reused_bytes >= 200000);
+    mfree(grown);
+
+    printf("--- EXTEND TAIL TEST END ---\n");
+}
+
+void test_txn_rollback()
+{
+    printf("\n--- TXN TEST START ---\n");
+
+    void *keep = mmalloc(32);
+
+    dm_txn_begin();
+    void *a = mmalloc(64);
+    mmalloc(128);
+    mfree(a); // freed inside the scope, must not be freed again
+    mmalloc(16);
+    printf("Inside scope:\n");
+    print_heap();
+
+    dm_txn_rollback();
+    printf("\nAfter rollback (only the 32 byte block in use):\n");
+    print_heap();
+
+    dm_txn_begin();
+    size_t n = 0;
+    while (n < 5000 && mmalloc(8))
+        n++;
+    dm_txn_rollback();
+    HeapStats st;
+    dm_get_stats(&st);
+    printf("\n5000 blocks in one scope: %d, all rolled back: %d\n", n == 5000, st.used_blocks == 1);
+
+    mfree(keep);
+    printf("--- TXN TEST END ---\n");
+}
+
+void test_mallinfo()
+{
+    printf("\n--- MALLINFO TEST START ---\n");
+
+    void *a = mmalloc(100);
+    void *b = mmalloc(5000);
+    DmMallinfo mi = dm_mallinfo2();
+    printf("in use: uordblks=%zu (expect 104 + 5000)\n", mi.uordblks);
+
+    mfree(b);
+    mi = dm_mallinfo2();
+    printf("after free: arena=%zu ordblks=%zu fordblks=%zu keepcost=%zu\n",
+           mi.arena, mi.ordblks, mi.fordblks, mi.keepcost);
+
+    printf("malloc_trim(0) released: %d\n", dm_malloc_trim(0));
+    mi = dm_mallinfo2();
+    printf("after trim: arena=%zu keepcost=%zu\n", mi.arena, mi.keepcost);
+
+    mfree(a);
+    printf("--- MALLINFO TEST END ---\n");
+}
+
+static int ctor_calls = 0;
+static int dtor_calls = 0;
+
+static void counter_ctor(void *obj)
+{
+    ctor_calls++;
+    *(int *)obj = 42;
+}
+
+static void counter_dtor(void *obj)
+{
+    (void)obj;
+    dtor_calls++;
+}
+
+void test_objcache()
+{
+    printf("\n--- OBJCACHE TEST START ---\n");
+
+    ObjCache *cache = dm_objcache_create(sizeof(int) * 16, 64, counter_ctor, counter_dtor);
+    int *a = dm_objcache_alloc(cache);
+    printf("constructed: %d, aligned: %d\n", *a, ((uintptr_t)a % 64) == 0);
+
+    int ctors = ctor_calls;
+    *a = 7; // state kept across free
+    dm_objcache_free(a);
+    int *b = dm_objcache_alloc(cache);
+    printf("reused: %d, value kept: %d, no new ctor: %d\n", a == b, *b, ctor_calls == ctors);
+
+    dm_objcache_free(b);
+    size_t reaped = dm_objcache_reap(cache);
+    printf("reaped slabs: %zu, dtors run for all: %d\n", reaped, dtor_calls == ctor_calls);
+    dm_objcache_destroy(cache);
+
+    printf("--- OBJCACHE TEST END ---\n");
+}
+
+static int arena_order[3];
+static int arena_dtors = 0;
+
+static void record_dtor(void *obj)
+{
+    arena_order[arena_dtors++] = *(int *)obj;
+}
+
+void test_arena()
+{
+    printf("\n--- ARENA TEST START ---\n");
+
+    Arena *arena = dm_arena_create(256);
+    for (int i = 0; i < 3; i++)
+        *(int *)dm_arena_alloc_dtor(arena, sizeof(int), 0, record_dtor) = i;
+    char *big = dm_arena_alloc(arena, 1000, 64); // bigger than a chunk
+    printf("big block aligned: %d\n", ((uintptr_t)big % 64) == 0);
+
+    dm_arena_reset(arena);
+    printf("dtors run newest first: %d %d %d\n", arena_order[0], arena_order[1], arena_order[2]);
+    int *reused = dm_arena_alloc(arena, sizeof(int), 0);
+    printf("reset keeps a chunk: %d\n", arena->chunks != NULL && reused != NULL);
+    dm_arena_destroy(arena);
+
+    printf("--- ARENA TEST END ---\n");
+}
+
+void test_purge()
+{
+    printf("\n--- PURGE TEST START ---\n");
+
+    size_t size = 64 * 4096;
+    char *block = mmalloc(size);
+    void *guard = mmalloc(16); // keeps the block off the heap top, so trim leaves it
+    memset(block, 1, size);
+    mfree(block);
+    HeapStats before, after;
+    dm_get_stats(&before);
+    size_t released = dm_purge();
+    dm_get_stats(&after);
+    printf("free pages released: %d, counted: %d\n", released >= size - 2 * 4096,
+           after.purged_bytes - before.purged_bytes == released);
+    char *again = mmalloc(size);
+    printf("reused after purge: %d, reads zeros: %d\n", again == block, again[size / 2] == 0);
+    mfree(again);
+    mfree(guard);
+
+    printf("--- PURGE TEST END ---\n");
+}
+
+static const char COLD_TEXT[] = "cold cache entry ";
+
+void test_cold()
+{
+    printf("\n--- COLD ARENA TEST START ---\n");
+
+    size_t pages = 64, page = (size_t)sysconf(_SC_PAGESIZE);
+    ColdArena *arena = dm_cold_create(pages * page);
+    if (!arena)
+    {
+        printf("userfaultfd unavailable, skipped\n--- COLD ARENA TEST END ---\n");
+        return;
+    }
+    char *data = dm_cold_alloc(arena, pages * page, page);
+    for (size_t i = 0; i < pages * page / 2; i++)
+        data[i] = COLD_TEXT[i % (sizeof(COLD_TEXT) - 1)];
+    for (size_t i = pages * page / 2; i < pages * page; i++)
+        data[i] = (char)(rand() >> 7); // does not compress
+
+    size_t released = dm_cold_sweep(arena, 1);
+    printf("nothing idle yet: %d\n", released == 0);
+    released = dm_cold_sweep(arena, 1);
+    ColdStats st;
+    dm_cold_stats(arena, &st);
+    printf("text pages released: %d, random ones kept: %d, ratio above 4: %d\n",
+           released == pages / 2 && st.packed_pages == pages / 2, st.incompressible == pages / 2, st.ratio > 4);
+
+    int same = 1;
+    for (size_t i = 0; i < pages * page / 2; i++)
+        same &= data[i] == COLD_TEXT[i % (sizeof(COLD_TEXT) - 1)];
+    dm_cold_stats(arena, &st);
+    printf("read back intact: %d, one fault per page: %d, all resident: %d\n", same,
+           st.faults == pages / 2, st.resident_pages == pages);
+    dm_cold_destroy(arena);
+
+    printf("--- COLD ARENA TEST END ---\n");
+}
+
+#define INHERITED 2000
+
+static int pattern_kept(const unsigned char *p, size_t n, unsigned char v)
+{
+    for (size_t i = 0; i < n; i++)
+        if (p[i] != v)
+            return 0;
+    return 1;
+}
+
+void test_cow_fork()
+{
+    printf("\n--- COW FORK TEST START ---\n");
+
+    dm_configure("cow:1,coalesce:lazy");
+    static unsigned char *blocks[INHERITED];
+    void *small = mmalloc(4 * 64 + 3 * sizeof(BlockHeader)); // four batch blocks exactly
+    for (int i = 0; i < INHERITED; i++)
+    {
+        blocks[i] = mmalloc(4072);
+        memset(blocks[i], i & 0xff, 4072);
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // free every other inherited block, then allocate around the live ones
+        mfree(small);
+        for (int i = 1; i < INHERITED; i += 2)
+            mfree(blocks[i]);
+        unsigned char *aligned = dm_aligned_alloc(2048, 100);
+        memset(aligned, 0xaa, 100);
+        unsigned char *moved = mrelloc(blocks[0], 8000);
+        memset(moved + 4072, 0xbb, 8000 - 4072);
+        void *batch[4];
+        size_t got = dm_malloc_batch(64, batch, 4);
+        for (size_t i = 0; i < got; i++)
+            memset(batch[i], 0xcc, 64);
+        void *later[16];
+        for (int i = 0; i < 16; i++)
+            memset(later[i] = mmalloc(i % 2 ? 64 : 2040), 0xdd, i % 2 ? 64 : 2040); // none handed out twice
+
+        int intact = pattern_kept(moved, 4072, 0) && pattern_kept(aligned, 100, 0xaa);
+        for (size_t i = 0; i < got; i++)
+            intact &= pattern_kept(batch[i], 64, 0xcc);
+        for (int i = 2; i < INHERITED; i += 2)
+            intact &= pattern_kept(blocks[i], 4072, (unsigned char)(i & 0xff));
+        printf("child: aligned: %d, batch: %zu, nothing overwritten: %d\n",
+               (uintptr_t)aligned % 2048 == 0, got, intact);
+        mfree(aligned);
+        mfree(moved);
+        dm_free_batch(batch, got);
+        dm_free_batch(later, 16);
+        fflush(stdout);
+        _exit(intact ? 0 : 1);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    int intact = 1;
+    for (int i = 0; i < INHERITED; i++)
+    {
+        intact &= pattern_kept(blocks[i], 4072, (unsigned char)(i & 0xff));
+        mfree(blocks[i]);
+    }
+    mfree(small);
+    printf("child exited cleanly: %d, parent blocks untouched: %d\n",
+           WIFEXITED(status) && WEXITSTATUS(status) == 0, intact);
+    dm_configure("cow:0,coalesce:eager");
+
+    printf("--- COW FORK TEST END ---\n");
+}
+
+void test_padded_array()
+{
+    printf("\n--- PADDED ARRAY TEST START ---\n");
+
+    size_t stride = dm_padded_stride(24);
+    char *slots = dm_alloc_padded_array(8, 24);
+    int aligned = 1, zeroed = 1;
+    for (int i = 0; i < 8; i++)
+    {
+        aligned &= (uintptr_t)(slots + i * stride) % DM_CACHE_LINE == 0;
+        zeroed &= slots[i * stride] == 0;
+    }
+    printf("stride one line: %d, elements on their own lines: %d, zeroed: %d\n",
+           stride == DM_CACHE_LINE, aligned, zeroed);
+    printf("wide element stride: %d, empty element stride: %d\n",
+           dm_padded_stride(DM_CACHE_LINE + 1) == 2 * DM_CACHE_LINE, dm_padded_stride(0) == DM_CACHE_LINE);
+    mfree(slots);
+
+    printf("--- PADDED ARRAY TEST END ---\n");
+}
+
+void test_lifetime()
+{
+    printf("\n--- LIFETIME TEST START ---\n");
+
+    dm_configure("lifetime:1");
+    void *live[3];
+    for (int i = 0; i < 100; i++)
+        mfree(mmalloc(40)); // every one sampled, all die young
+    for (int i = 0; i < 3; i++)
+        live[i] = mmalloc(40);
+
+    FILE *out = tmpfile();
+    dm_lifetime_dump(out);
+    rewind(out);
+    char line[512];
+    int header = 0;
+    size_t died = 0, most_live = 0;
+    while (fgets(line, sizeof(line), out))
+    {
+        size_t v[10] = {0}, size;
+        void *site;
+        if (strstr(line, "size class") && strstr(line, "<1us") && strstr(line, ">=10s"))
+            header = 1;
+        else if (sscanf(line, "<= %zu %zu %zu %zu %zu %zu %zu %zu %zu %zu", &size, &v[0], &v[1], &v[2], &v[3],
+                        &v[4], &v[5], &v[6], &v[7], &v[8]) == 10 && size == 64)
+            for (int b = 0; b < 9; b++)
+                died += v[b];
+        else if (sscanf(line, "%p %zu %zu %zu %zu %zu %zu %zu %zu %zu %zu", &site, &v[0], &v[1], &v[2], &v[3],
+                        &v[4], &v[5], &v[6], &v[7], &v[8], &v[9]) == 11 && v[9] > most_live)
+            most_live = v[9];
+    }
+    fclose(out);
+    printf("age buckets printed: %d, 64 byte class deaths: %zu, live at one site: %zu\n", header, died, most_live);
+    for (int i = 0; i < 3; i++)
+        mfree(live[i]);
+    dm_configure("lifetime:0");
+
+    printf("--- LIFETIME TEST END ---\n");
+}
+
+void test_profile()
+{
+    printf("\n--- WARM-UP PROFILE TEST START ---\n");
+
+    enum { COUNT = 50, SIZE = 12000 }; // class region blocks of 16384 bytes
+    char path[64], conf[96];
+    snprintf(path, sizeof(path), "/tmp/dm_profile_%d", (int)getpid());
+    snprintf(conf, sizeof(conf), "classes:1,profile:%s", path);
+    remove(path);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // the profile is written at exit
+        dm_configure(conf);
+        void *blocks[COUNT];
+        for (int i = 0; i < COUNT; i++)
+            blocks[i] = mmalloc(SIZE);
+        for (int i = 0; i < COUNT; i++)
+            mfree(blocks[i]);
+        exit(0);
+    }
+    waitpid(pid, NULL, 0);
+
+    size_t size = 0, count = 0, a, b;
+    FILE *f = fopen(path, "r");
+    char line[128];
+    while (f && fgets(line, sizeof(line), f))
+        if (sscanf(line, "class %zu %zu", &a, &b) == 2 && a == 16384)
+            size = a, count = b;
+    if (f)
+        fclose(f);
+    remove(path);
+    printf("class region blocks recorded: %d\n", count >= COUNT);
+
+    HeapStats before, after;
+    dm_warmup(&size, &count, 1);
+    dm_get_stats(&before);
+    void *blocks[COUNT];
+    for (int i = 0; i < COUNT; i++)
+        blocks[i] = mmalloc(SIZE);
+    dm_get_stats(&after);
+    printf("served from the warm-up: %d, no sbrk: %d\n",
+           after.reused_bytes - before.reused_bytes >= (size_t)COUNT * SIZE, after.sbrk_calls == before.sbrk_calls);
+    for (int i = 0; i < COUNT; i++)
+        mfree(blocks[i]);
+
+    printf("--- WARM-UP PROFILE TEST END ---\n");
+}
+
+static void *teardown_block;
+
+static void free_at_exit()
+{
+    // registered before the fast_exit hook, so it runs after it
+    HeapStats before, after;
+    dm_get_stats(&before);
+    mfree(teardown_block);
+    dm_get_stats(&after);
+    _exit(after.skipped_frees == before.skipped_frees + 1 && after.in_use_bytes == before.in_use_bytes ? 0 : 1);
+}
+
+void test_fast_exit()
+{
+    printf("\n--- FAST EXIT TEST START ---\n");
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // dm_begin_shutdown cannot be undone, so only a child enters it
+        atexit(free_at_exit);
+        dm_configure("fast_exit:1");
+        HeapStats st;
+        dm_get_stats(&st);
+        size_t skipped = st.skipped_frees;
+        mfree(mmalloc(100));
+        dm_get_stats(&st);
+        if (st.skipped_frees != skipped)
+            _exit(2);
+        teardown_block = mmalloc(4096);
+        exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    printf("freed normally before exit: %d, skipped after: %d\n",
+           WIFEXITED(status) && WEXITSTATUS(status) != 2, WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    printf("--- FAST EXIT TEST END ---\n");
+}
+
+void test_working_set()
+{
+    printf("\n--- WORKING SET TEST START ---\n");
+
+    size_t size = 64 * 4096;
+    char *hot = mmalloc(size);
+    char *cold = mmalloc(size);
+    memset(hot, 1, size);
+    memset(cold, 1, size);
+    int method = dm_ws_mark_idle();
+    memset(hot, 2, size); // only this block is touched after the mark
+
+    DmWorkingSet ws;
+    int rc = dm_ws_sample(&ws);
+    printf("method: %d, sampled: %d, both blocks resident: %d\n", method, rc == 0, ws.resident_bytes >= 2 * size);
+    printf("written block hot: %d, hot + cold = resident: %d\n", ws.hot_bytes >= size,
+           ws.hot_bytes + ws.cold_bytes == ws.resident_bytes);
+    mfree(hot);
+    mfree(cold);
+
+    printf("--- WORKING SET TEST END ---\n");
+}
+
+void test_collapse_hot()
+{
+    printf("\n--- COLLAPSE HOT TEST START ---\n");
+
+    size_t bytes = 6 << 20; // holds at least two aligned 2 MiB ranges
+    char *hot = mmalloc(bytes);
+    memset(hot, 1, bytes);
+    DmCollapseReport report;
+    int rc = dm_collapse_hot(0, &report);
+    // either is fine, MADV_COLLAPSE depends on the kernel
+    printf("ran: %d, method known: %d, dense ranges found: %d, accepted within them: %d\n", rc == 0,
+           report.method == DM_COLLAPSE_SYNC || report.method == DM_COLLAPSE_HINT, report.candidates >= 2,
+           report.collapsed_bytes <= report.candidates * (2 << 20));
+    errno = 0;
+    printf("again too soon: %d\n", dm_collapse_hot(0, &report) == -1 && errno == EAGAIN);
+    mfree(hot);
+
+    printf("--- COLLAPSE HOT TEST END ---\n");
+}
+
+void test_jit()
+{
+    printf("\n--- JIT TEST START ---\n");
+
+    JitHeap *heap = dm_jit_create(0);
+    void *rw;
+    unsigned char *code = dm_jit_alloc(heap, 64, &rw);
+    if (!code)
+    {
+        printf("executable mappings refused, skipped\n--- JIT TEST END ---\n");
+        dm_jit_destroy(heap);
+        return;
+    }
+#if defined(__x86_64__)
+    static const unsigned char ret42[] = {0xb8, 0x2a, 0x00, 0x00, 0x00, 0xc3}; // mov eax, 42; ret
+#elif defined(__aarch64__)
+    static const unsigned char ret42[] = {0x40, 0x05, 0x80, 0x52, 0xc0, 0x03, 0x5f, 0xd6}; // mov w0, #42; ret
+#else
+    static const unsigned char ret42[] = {0};
+#endif
+    memcpy(rw, ret42, sizeof(ret42));
+    printf("two views: %d, write seen through rx: %d\n", (void *)code != rw, memcmp(code, ret42, sizeof(ret42)) == 0);
+    printf("writable alias found again: %d\n", dm_jit_writable(heap, code) == rw);
+
+    dm_jit_commit(heap, code, sizeof(ret42));
+    dm_jit_flush(heap);
+#if defined(__x86_64__) || defined(__aarch64__)
+    int (*fn)(void);
+    memcpy(&fn, &code, sizeof(fn));
+    printf("generated code returns: %d\n", fn());
+#endif
+    dm_jit_free(heap, code);
+    void *again = dm_jit_alloc(heap, 64, &rw);
+    printf("freed block reused: %d, flushes: %zu\n", again == code, heap->flushes);
+
+    // a large block has its own region, its queued range goes with it
+    void *big_rw;
+    char *big = dm_jit_alloc(heap, 3 * DM_JIT_MAX_CLASS, &big_rw);
+    memcpy(big_rw, ret42, sizeof(ret42));
+    dm_jit_commit(heap, again, sizeof(ret42));
+    dm_jit_commit(heap, big, sizeof(ret42));
+    size_t queued = heap->pending;
+    dm_jit_free(heap, big);
+    printf("regions not merged: %d, freed range dropped: %d\n", queued == 2, heap->pending == 1);
+    dm_jit_flush(heap);
+    printf("flush after free survived: %d\n", heap->pending == 0);
+    dm_jit_destroy(heap);
+
+    printf("--- JIT TEST END ---\n");
+}
+
+#define CARVERS 4
+#define CARVED 2000
+static void *carved[CARVERS * CARVED];
+
+static void *carve(void *arg)
+{
+    void **out = arg;
+    for (int i = 0; i < CARVED; i++)
+        out[i] = mmalloc(48);
+    return NULL;
+}
+
+static int cmp_ptr(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t)*(void *const *)a, y = (uintptr_t)*(void *const *)b;
+    return (x > y) - (x < y);
+}
+
+void test_class_regions()
+{
+    printf("\n--- CLASS REGION TEST START ---\n");
+
+    dm_configure("classes:1");
+    pthread_t threads[CARVERS];
+    for (int t = 0; t < CARVERS; t++)
+        pthread_create(&threads[t], NULL, carve, carved + t * CARVED);
+    for (int t = 0; t < CARVERS; t++)
+        pthread_join(threads[t], NULL);
+
+    // blocks bumped concurrently must never overlap
+    qsort(carved, CARVERS * CARVED, sizeof(void *), cmp_ptr);
+    int distinct = carved[0] != NULL, sized = 1;
+    for (int i = 0; i < CARVERS * CARVED; i++)
+    {
+        if (i > 0 && (char *)carved[i] < (char *)carved[i - 1] + 64)
+            distinct = 0;
+        if (dm_malloc_usable_size(carved[i]) != 64 || (uintptr_t)carved[i] % 64)
+            sized = 0;
+    }
+    printf("%d blocks from %d threads distinct: %d, 64 byte class aligned: %d\n",
+           CARVERS * CARVED, CARVERS, distinct, sized);
+    dm_free_batch(carved, CARVERS * CARVED);
+    HeapStats st;
+    dm_get_stats(&st);
+    printf("all returned: %d\n", st.region_in_use_bytes == 0);
+    dm_configure("classes:0");
+
+    printf("--- CLASS REGION TEST END ---\n");
+}
+
+static const size_t wanted[3] = {0, 3072, 2048};
+static void *granted[3];
+static int served[2];
+static int served_count = 0;
+
+static void *wait_budget(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    granted[id] = dm_malloc_wait(wanted[id], -1);
+    served[__atomic_fetch_add(&served_count, 1, __ATOMIC_SEQ_CST)] = id;
+    return NULL;
+}
+
+static void *wait_budget_briefly(void *arg)
+{
+    return dm_malloc_wait((size_t)(intptr_t)arg, 2000);
+}
+
+static void wait_queued(size_t waits)
+{
+    HeapStats st;
+    do
+    {
+        sched_yield();
+        dm_get_stats(&st);
+    } while (st.budget_waits < waits);
+}
+
+void test_budget()
+{
+    printf("\n--- BUDGET TEST START ---\n");
+
+    dm_configure("budget:4096");
+    HeapStats st;
+    dm_get_stats(&st);
+    size_t waits = st.budget_waits;
+    void *small = mmalloc(1024);
+    void *large = mmalloc(3072);
+    printf("over budget refused: %d\n", mmalloc(1) == NULL);
+    errno = 0;
+    printf("wait timed out: %d\n", dm_malloc_wait(1024, 20) == NULL && errno == ETIMEDOUT);
+
+    pthread_t threads[3];
+    pthread_create(&threads[1], NULL, wait_budget, (void *)1);
+    wait_queued(waits + 2);
+    pthread_create(&threads[2], NULL, wait_budget, (void *)2);
+    wait_queued(waits + 3);
+
+    mfree(small); // not enough for the first waiter, the second must not pass it
+    usleep(20000);
+    printf("nobody served early: %d\n", __atomic_load_n(&served_count, __ATOMIC_SEQ_CST) == 0);
+    mfree(large);
+    while (__atomic_load_n(&served_count, __ATOMIC_SEQ_CST) < 1)
+        sched_yield();
+    int first = served[0];
+    mfree(granted[first]); // makes room for the other one
+    pthread_join(threads[1], NULL);
+    pthread_join(threads[2], NULL);
+    printf("served in arrival order: %d %d\n", first, served[1]);
+    mfree(granted[3 - first]);
+
+    dm_get_stats(&st);
+    void *shrunk = mmalloc(4000);
+    pthread_create(&threads[0], NULL, wait_budget_briefly, (void *)3072);
+    wait_queued(st.budget_waits + 1);
+    shrunk = mrelloc(shrunk, 512); // in place, gives back room for the waiter
+    void *woken;
+    pthread_join(threads[0], &woken);
+    uint64_t waited = st.budget_wait_ns;
+    dm_get_stats(&st);
+    waited = st.budget_wait_ns - waited;
+    printf("in place shrink wakes a waiter: %d\n", woken != NULL && waited < 1000000000u);
+    mfree(woken);
+    mfree(shrunk);
+    dm_configure("budget:0");
+
+    printf("--- BUDGET TEST END ---\n");
+}
+
+void test_numa_fake()
+{
+    printf("\n--- NUMA TEST START ---\n");
+
+    dm_configure("numa_nodes:4"); // placement as if there were 4 nodes
+    size_t pages = 64, per_node[4];
+    char *table = dm_malloc_numa(pages * 4096, DM_NUMA_INTERLEAVE);
+    memset(table, 1, pages * 4096);
+    long resident = dm_numa_residency(table, per_node, 4);
+    printf("interleaved: %ld pages, per node %zu %zu %zu %zu\n",
+           resident, per_node[0], per_node[1], per_node[2], per_node[3]);
+    mfree(table);
+
+    char *local = dm_malloc_numa(4096, DM_NUMA_NODE(3));
+    local[0] = 1;
+    dm_numa_residency(local, per_node, 4);
+    printf("bound to node 3: %zu page(s) there\n", per_node[3]);
+    mfree(local);
+    printf("node 7 refused: %d\n", dm_malloc_numa(4096, DM_NUMA_NODE(7)) == NULL);
+    dm_configure("numa_nodes:0");
+
+    printf("--- NUMA TEST END ---\n");
+}
+
+void test_trace_replay()
+{
+    printf("\n--- TRACE REPLAY TEST START ---\n");
+
+    static const char *names[] = {"latency", "footprint", "syscalls"};
+    for (int i = 0; i < 3; i++)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "tests/traces/fuzz-%s.txt", names[i]);
+        Trace trace = {0};
+        if (trace_load(path, &trace) != 0)
+        {
+            printf("%s: not found, run from the repository root\n", path);
+            trace_free(&trace);
+            continue;
+        }
+        HeapStats before, after;
+        dm_get_stats(&before);
+        ReplayResult r;
+        int rc = trace_replay(&trace, &r);
+        dm_get_stats(&after);
+        printf("%s: %zu ops replayed: %d, all freed again: %d\n", names[i], trace.count, rc == 0,
+               after.in_use_bytes == before.in_use_bytes && after.used_blocks == before.used_blocks);
+        trace_free(&trace);
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/dm_trace_%d", (int)getpid());
+    FILE *f = fopen(path, "w");
+    fprintf(f, "a 4000000000 8\n"); // would size the slot table at 32 GB
+    fclose(f);
+    Trace stray = {0};
+    printf("id past the op count rejected: %d\n", trace_load(path, &stray) == -1);
+    trace_free(&stray);
+    remove(path);
+
+    printf("--- TRACE REPLAY TEST END ---\n");
+}
+
+void test_intern()
+{
+    printf("\n--- INTERN TEST START ---\n");
+
+    InternPool *pool = dm_intern_create(0, DM_INTERN_REFCOUNT);
+    uint32_t a_id, b_id;
+    const char *a = dm_intern(pool, "user_id", 7, &a_id);
+    const char *b = dm_intern(pool, "user_id", 7, &b_id);
+    printf("deduplicated: %d, same id: %d, by id: %s\n", a == b, a_id == b_id, dm_intern_str(pool, a_id));
+
+    dm_intern_release(pool, a_id);
+    printf("still there after one release: %d\n", dm_intern_str(pool, a_id) == a);
+    dm_intern_release(pool, b_id);
+    printf("gone after the last: %d, strings: %zu\n", dm_intern_str(pool, a_id) == NULL, pool->strings);
+    dm_intern_destroy(pool);
+
+    printf("--- INTERN TEST END ---\n");
+}
+
 int main(void)
 {
     printf("BLOCK HEADER SIZE : %d bytes\n", sizeof(BlockHeader));
     test_malloc_free();
+    test_extend_tail();
+    test_txn_rollback();
+    test_mallinfo();
+    test_objcache();
+    test_arena();
+    test_purge();
+    test_cold();
+    test_cow_fork();
+    test_padded_array();
+    test_lifetime();
+    test_profile();
+    test_fast_exit();
+    test_working_set();
+    test_collapse_hot();
+    test_jit();
+    test_class_regions();
+    test_budget();
+    test_numa_fake();
+    test_trace_replay();
+    test_intern();
     return 0;
 }
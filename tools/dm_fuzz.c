@@ -0,0 +1,501 @@
+/*
+ * dm_fuzz: search for allocation sequences the allocator handles badly.
+ *
+ *   dm_fuzz [-n iterations] [-s seed] [-l max ops] [-r runs] [-k keep]
+ *           [-c conf] [-o dir] [seed traces...]
+ *
+ * Starting from a few synthetic patterns and any traces given on the
+ * command line, every iteration picks a trace from the archive, mutates
+ * it and replays the result in a fresh forked process, configured with
+ * `conf` if given, so no replay inherits blocks or free lists left over
+ * from the previous one. Each replay is scored three ways:
+ *
+ *   latency    mean ns per op, median of `runs` replays
+ *   footprint  heap bytes mapped per byte of peak live data
+ *   syscalls   sbrk, mmap/munmap and class region commit calls per
+ *              thousand ops
+ *
+ * The `keep` worst traces of each score stay in the archive and are the
+ * parents of later iterations. At the end the worst trace of each score
+ * is written to `dir` as fuzz-<score>.txt, ready for dm_tune or
+ * trace_replay in the regression suite.
+ *
+ *   gcc -O2 -Iinclude -Itools tools/dm_fuzz.c tools/dm_trace.c src/dm_alloc.c -o dm_fuzz
+ */
+
+#include "dm_alloc.h"
+#include "dm_trace.h"
+
+#include <stdlib.h>
+#include <sys/wait.h>
+
+#define MAX_RUNS 32
+#define MAX_KEEP 16
+#define MAX_SIZE (1 << 20)
+
+enum
+{
+    SCORE_LATENCY,
+    SCORE_FOOTPRINT,
+    SCORE_SYSCALLS,
+    N_SCORES
+};
+
+static const char *SCORE_NAMES[N_SCORES] = {"latency", "footprint", "syscalls"};
+
+/**
+ * @brief an archived trace and how badly it went.
+ */
+typedef struct Entry
+{
+    Trace trace;
+    double score;
+} Entry;
+
+/**
+ * @brief worst traces found so far for one score, worst first.
+ */
+typedef struct Archive
+{
+    Entry entries[MAX_KEEP];
+    int count;
+} Archive;
+
+static Archive archives[N_SCORES];
+static int keep = 4;
+static size_t max_ops = 4000;
+static uint64_t rng = 0x9e3779b97f4a7c15ull;
+
+static uint64_t next_random()
+{
+    // xorshift64*, reproducible for a given -s
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 0x2545f4914f6cdd1dull;
+}
+
+/**
+ * @brief uniform value in [0, n)
+ */
+static size_t pick(size_t n)
+{
+    return n ? (size_t)(next_random() % n) : 0;
+}
+
+/**
+ * @brief request size, biased towards the sizes allocators treat specially
+ */
+static size_t random_size()
+{
+    switch (pick(6))
+    {
+    case 0:
+        return 1 + pick(64);
+    case 1:
+        return 1 + pick(1024);
+    case 2:
+        return 1 + pick(64 * 1024);
+    case 3:
+        return 1 + pick(MAX_SIZE);
+    default:
+    {
+        // a power of two or one byte either side of it
+        size_t p = (size_t)1 << (3 + pick(18));
+        return p - 1 + pick(3);
+    }
+    }
+}
+
+static int copy_trace(Trace *dst, const Trace *src)
+{
+    *dst = (Trace){0};
+    for (size_t i = 0; i < src->count; i++)
+    {
+        const TraceOp *op = &src->ops[i];
+        if (trace_push(dst, op->op, op->id, op->size) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief synthetic starting points: random churn and the classic orders
+ */
+static void seed_pattern(Trace *t, int kind, size_t n)
+{
+    *t = (Trace){0};
+    uint32_t id = 0;
+    if (kind == 0)
+    {
+        // random churn around a steady live set
+        uint32_t live = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            int r = (int)pick(10);
+            if (live > 0 && r < 4)
+                trace_push(t, 'f', (uint32_t)pick(id), 0);
+            else if (live > 0 && r == 4)
+                trace_push(t, 'r', (uint32_t)pick(id), random_size());
+            else
+            {
+                trace_push(t, 'a', id++, random_size());
+                live++;
+            }
+        }
+    }
+    else if (kind == 1 || kind == 2)
+    {
+        // allocate a batch, free it last-in-first-out or first-in-first-out
+        size_t batch = n / 2;
+        size_t size = random_size();
+        for (size_t i = 0; i < batch; i++)
+            trace_push(t, 'a', id++, size);
+        for (size_t i = 0; i < batch; i++)
+            trace_push(t, 'f', kind == 1 ? (uint32_t)(batch - 1 - i) : (uint32_t)i, 0);
+    }
+    else
+    {
+        // many small live objects pinning a few freed large ones
+        for (size_t i = 0; i + 3 < n; i += 3)
+        {
+            trace_push(t, 'a', id++, 16 + pick(48));
+            trace_push(t, 'a', id, 4096 + pick(8192));
+            trace_push(t, 'f', id++, 0);
+        }
+    }
+}
+
+/**
+ * @brief renumber the ids of `t` densely in order of first use
+ *
+ * Mutations put copies on ids above `slots` and truncation or dropped
+ * ops leave holes, so without this ids would grow with every generation.
+ */
+static void compact_ids(Trace *t)
+{
+    uint32_t *remap = malloc((t->slots ? t->slots : 1) * sizeof(uint32_t));
+    if (!remap)
+        return; // sparse ids still replay, just with a larger slot table
+    memset(remap, 0xff, (t->slots ? t->slots : 1) * sizeof(uint32_t));
+    uint32_t next = 0;
+    for (size_t i = 0; i < t->count; i++)
+    {
+        uint32_t *id = &remap[t->ops[i].id];
+        if (*id == UINT32_MAX)
+            *id = next++;
+        t->ops[i].id = *id;
+    }
+    t->slots = next;
+    free(remap);
+}
+
+/**
+ * @brief apply one random mutation to `t`, `other` feeds the crossover
+ */
+static void mutate(Trace *t, const Trace *other)
+{
+    Trace out = {0};
+    size_t n = t->count;
+    size_t a = pick(n + 1), b = a + pick(n - a + 1);
+    uint32_t fresh = t->slots;
+
+    switch (pick(6))
+    {
+    case 0:
+        // resize one allocation or reallocation
+        for (int tries = 0; tries < 8 && n; tries++)
+        {
+            TraceOp *op = &t->ops[pick(n)];
+            if (op->op == 'f')
+                continue;
+            switch (pick(3))
+            {
+            case 0:
+                op->size = op->size * 2 < MAX_SIZE ? op->size * 2 : MAX_SIZE;
+                break;
+            case 1:
+                op->size = op->size / 2 ? op->size / 2 : 1;
+                break;
+            default:
+                op->size = random_size();
+            }
+            break;
+        }
+        return;
+    case 1:
+    {
+        // burst of one size at `a`, optionally punching every other one out
+        size_t count = 8 + pick(256), size = random_size();
+        int holes = (int)pick(2);
+        for (size_t i = 0; i < a; i++)
+            trace_push(&out, t->ops[i].op, t->ops[i].id, t->ops[i].size);
+        for (size_t i = 0; i < count; i++)
+            trace_push(&out, 'a', fresh + (uint32_t)i, size);
+        for (size_t i = 0; holes && i < count; i += 2)
+            trace_push(&out, 'f', fresh + (uint32_t)i, 0);
+        for (size_t i = a; i < n; i++)
+            trace_push(&out, t->ops[i].op, t->ops[i].id, t->ops[i].size);
+        break;
+    }
+    case 2:
+        // drop the ops in [a, b)
+        for (size_t i = 0; i < n; i++)
+        {
+            if (i < a || i >= b)
+                trace_push(&out, t->ops[i].op, t->ops[i].id, t->ops[i].size);
+        }
+        break;
+    case 3:
+        // append a copy of [a, b) on fresh ids
+        for (size_t i = 0; i < n; i++)
+            trace_push(&out, t->ops[i].op, t->ops[i].id, t->ops[i].size);
+        for (size_t i = a; i < b; i++)
+            trace_push(&out, t->ops[i].op, t->ops[i].id + fresh, t->ops[i].size);
+        break;
+    case 4:
+        // hold a free back to the end, stretching its object's lifetime
+        for (int tries = 0; tries < 8 && n; tries++)
+        {
+            size_t i = pick(n);
+            if (t->ops[i].op != 'f')
+                continue;
+            TraceOp op = t->ops[i];
+            memmove(&t->ops[i], &t->ops[i + 1], (n - i - 1) * sizeof(TraceOp));
+            t->ops[n - 1] = op;
+            break;
+        }
+        return;
+    default:
+        // prefix of `t` followed by a suffix of `other` on fresh ids
+        if (!other || !other->count)
+            return;
+        for (size_t i = 0; i < a; i++)
+            trace_push(&out, t->ops[i].op, t->ops[i].id, t->ops[i].size);
+        for (size_t i = pick(other->count); i < other->count; i++)
+            trace_push(&out, other->ops[i].op, other->ops[i].id + fresh, other->ops[i].size);
+        break;
+    }
+
+    if (out.count > max_ops)
+        out.count = max_ops;
+    compact_ids(&out);
+    trace_free(t);
+    *t = out;
+}
+
+/**
+ * @brief replay `trace` in a child under `conf`, the result comes back
+ * through a pipe
+ */
+static int replay_forked(const Trace *trace, const char *conf, ReplayResult *out)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+        return -1;
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0)
+    {
+        ReplayResult r = {0};
+        close(fds[0]);
+        int ok = (!conf || dm_configure(conf) == 0) && trace_replay(trace, &r) == 0;
+        if (ok && write(fds[1], &r, sizeof(r)) != (ssize_t)sizeof(r))
+            ok = 0;
+        _exit(ok ? 0 : 1);
+    }
+
+    close(fds[1]);
+    ssize_t n = read(fds[0], out, sizeof(*out));
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (n != (ssize_t)sizeof(*out) || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+    return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief score `trace` by the median of `runs` replays
+ *
+ * @return 0 on success, -1 if a replay failed
+ */
+static int evaluate(const Trace *trace, const char *conf, int runs, double scores[N_SCORES])
+{
+    double values[N_SCORES][MAX_RUNS];
+    for (int i = 0; i < runs; i++)
+    {
+        ReplayResult r;
+        if (replay_forked(trace, conf, &r) != 0)
+            return -1;
+        double ops = trace->count ? (double)trace->count : 1;
+        values[SCORE_LATENCY][i] = r.total_ns / ops;
+        values[SCORE_FOOTPRINT][i] = (double)r.mapped_bytes / (r.peak_live ? r.peak_live : 1);
+        values[SCORE_SYSCALLS][i] = (r.sbrk_calls + r.map_calls) * 1000.0 / ops;
+    }
+    for (int s = 0; s < N_SCORES; s++)
+    {
+        qsort(values[s], runs, sizeof(double), cmp_double);
+        scores[s] = values[s][runs / 2];
+    }
+    return 0;
+}
+
+/**
+ * @brief keep a copy of `trace` if it is among the worst for `s`
+ *
+ * @return 1 if it became the worst so far, else 0
+ */
+static int archive_insert(int s, const Trace *trace, double score)
+{
+    Archive *arc = &archives[s];
+    int at = arc->count;
+    while (at > 0 && arc->entries[at - 1].score < score)
+        at--;
+    if (at == keep)
+        return 0;
+
+    Entry entry = {.score = score};
+    if (copy_trace(&entry.trace, trace) != 0)
+    {
+        trace_free(&entry.trace);
+        return 0;
+    }
+    if (arc->count == keep)
+        trace_free(&arc->entries[--arc->count].trace);
+    memmove(&arc->entries[at + 1], &arc->entries[at], (arc->count - at) * sizeof(Entry));
+    arc->entries[at] = entry;
+    arc->count++;
+    return at == 0;
+}
+
+/**
+ * @brief random archived trace, NULL while the archive is empty
+ */
+static const Trace *random_parent()
+{
+    Archive *arc = &archives[pick(N_SCORES)];
+    return arc->count ? &arc->entries[pick(arc->count)].trace : NULL;
+}
+
+static void consider(const Trace *trace, const char *conf, int runs, size_t iter)
+{
+    double scores[N_SCORES];
+    if (evaluate(trace, conf, runs, scores) != 0)
+    {
+        fprintf(stderr, "dm_fuzz: replay failed\n");
+        return;
+    }
+    for (int s = 0; s < N_SCORES; s++)
+    {
+        if (archive_insert(s, trace, scores[s]))
+            printf("%6zu  new worst %-9s %12.2f  (%zu ops)\n", iter, SCORE_NAMES[s], scores[s],
+                   trace->count);
+    }
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: dm_fuzz [-n iterations] [-s seed] [-l max ops] [-r runs] [-k keep]\n"
+                    "               [-c conf] [-o dir] [seed traces...]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    size_t iterations = 500;
+    int runs = 3;
+    const char *conf = NULL;
+    const char *dir = "tests/traces";
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:l:r:k:c:o:")) != -1)
+    {
+        if (opt == 'n')
+            iterations = strtoul(optarg, NULL, 10);
+        else if (opt == 's')
+            rng = strtoull(optarg, NULL, 10) * 2 + 1; // xorshift must not start at 0
+        else if (opt == 'l')
+            max_ops = strtoul(optarg, NULL, 10);
+        else if (opt == 'r')
+            runs = atoi(optarg);
+        else if (opt == 'k')
+            keep = atoi(optarg);
+        else if (opt == 'c')
+            conf = optarg;
+        else if (opt == 'o')
+            dir = optarg;
+        else
+            usage();
+    }
+    if (runs < 1 || runs > MAX_RUNS || keep < 1 || keep > MAX_KEEP || max_ops < 16)
+        usage();
+
+    // the tool's own traces live in libc memory, the replays in the child's heap
+    for (int kind = 0; kind < 4; kind++)
+    {
+        Trace t;
+        seed_pattern(&t, kind, max_ops / 2);
+        consider(&t, conf, runs, 0);
+        trace_free(&t);
+    }
+    for (int i = optind; i < argc; i++)
+    {
+        Trace t = {0};
+        if (trace_load(argv[i], &t) != 0)
+        {
+            fprintf(stderr, "dm_fuzz: cannot read trace %s\n", argv[i]);
+            return 1;
+        }
+        if (t.count > max_ops)
+            t.count = max_ops;
+        consider(&t, conf, runs, 0);
+        trace_free(&t);
+    }
+
+    for (size_t iter = 1; iter <= iterations; iter++)
+    {
+        Trace t;
+        const Trace *parent = random_parent();
+        if (!parent || copy_trace(&t, parent) != 0)
+            break;
+        // a few stacked mutations per child lets the search leave local plateaus
+        int steps = 1 + (int)pick(3);
+        for (int i = 0; i < steps; i++)
+            mutate(&t, random_parent());
+        consider(&t, conf, runs, iter);
+        trace_free(&t);
+    }
+
+    int failed = 0;
+    printf("\n%-10s %12s %8s  %s\n", "score", "worst", "ops", "trace");
+    for (int s = 0; s < N_SCORES; s++)
+    {
+        Archive *arc = &archives[s];
+        if (!arc->count)
+            continue;
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/fuzz-%s.txt", dir, SCORE_NAMES[s]);
+        if (trace_save(path, &arc->entries[0].trace) != 0)
+        {
+            fprintf(stderr, "dm_fuzz: cannot write %s\n", path);
+            failed = 1;
+        }
+        printf("%-10s %12.2f %8zu  %s\n", SCORE_NAMES[s], arc->entries[0].score,
+               arc->entries[0].trace.count, path);
+        for (int i = 0; i < arc->count; i++)
+            trace_free(&arc->entries[i].trace);
+    }
+    return failed;
+}
@@ -0,0 +1,184 @@
+#include "dm_trace.h"
+#include "dm_alloc.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Trace files are text, one op per line:
+ *   a <id> <size>   ptr[id] = mmalloc(size)
+ *   r <id> <size>   ptr[id] = mrelloc(ptr[id], size)
+ *   f <id>          mfree(ptr[id])
+ * Lines starting with '#' are comments.
+ */
+
+/**
+ * @brief append an op, the tool side uses libc malloc for its own memory
+ *
+ * @return 0 on success, -1 if out of memory
+ */
+int trace_push(Trace *trace, char op, uint32_t id, size_t size)
+{
+    if (trace->count == trace->cap)
+    {
+        size_t cap = trace->cap ? trace->cap * 2 : 1024;
+        TraceOp *ops = realloc(trace->ops, cap * sizeof(TraceOp));
+        if (!ops)
+            return -1;
+        trace->ops = ops;
+        trace->cap = cap;
+    }
+    trace->ops[trace->count++] = (TraceOp){op, id, size};
+    if (id >= trace->slots)
+        trace->slots = id + 1;
+    return 0;
+}
+
+/**
+ * @brief read a trace file into `trace` (which must be zeroed)
+ *
+ * Ids must be below the number of ops, which dense ids (as dm_fuzz
+ * writes them) always are.
+ *
+ * @return 0 on success, -1 on an I/O error, a malformed line or an id
+ * out of range
+ */
+int trace_load(const char *path, Trace *trace)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+
+    char line[128];
+    int rc = 0;
+    while (rc == 0 && fgets(line, sizeof(line), f))
+    {
+        char op;
+        unsigned id;
+        size_t size = 0;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        int n = sscanf(line, " %c %u %zu", &op, &id, &size);
+        if (n < 2 || (op != 'f' && n < 3) || (op != 'a' && op != 'f' && op != 'r'))
+            rc = -1;
+        else
+            rc = trace_push(trace, op, id, size);
+    }
+    fclose(f);
+    // ids index the replay's slot table, a stray large one must not size it
+    if (rc == 0 && trace->slots > trace->count)
+        rc = -1;
+    return rc;
+}
+
+/**
+ * @brief write `trace` in the format trace_load reads
+ *
+ * @return 0 on success, -1 on an I/O error
+ */
+int trace_save(const char *path, const Trace *trace)
+{
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return -1;
+    for (size_t i = 0; i < trace->count; i++)
+    {
+        const TraceOp *op = &trace->ops[i];
+        if (op->op == 'f')
+            fprintf(f, "f %u\n", op->id);
+        else
+            fprintf(f, "%c %u %zu\n", op->op, op->id, op->size);
+    }
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+void trace_free(Trace *trace)
+{
+    free(trace->ops);
+    trace->ops = NULL;
+    trace->count = trace->cap = 0;
+    trace->slots = 0;
+}
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * @brief run `trace` against the allocator of this process.
+ *
+ * Ops on empty slots are skipped, so mutated traces stay replayable.
+ * Whatever is still live at the end is freed and not timed.
+ *
+ * @return 0 on success, -1 if the slot table could not be allocated
+ */
+int trace_replay(const Trace *trace, ReplayResult *out)
+{
+    void **slots = calloc(trace->slots ? trace->slots : 1, sizeof(void *));
+    size_t *sizes = calloc(trace->slots ? trace->slots : 1, sizeof(size_t));
+    if (!slots || !sizes)
+    {
+        free(slots);
+        free(sizes);
+        return -1;
+    }
+
+    HeapStats before, after;
+    dm_get_stats(&before);
+
+    ReplayResult r = {0};
+    size_t live = 0;
+    for (size_t i = 0; i < trace->count; i++)
+    {
+        const TraceOp *op = &trace->ops[i];
+        void **slot = &slots[op->id];
+        double start = now_ns();
+
+        if (op->op == 'a')
+        {
+            if (*slot)
+                continue; // the slot is taken, a mutation dropped its free
+            *slot = mmalloc(op->size);
+        }
+        else if (op->op == 'r')
+        {
+            void *p = mrelloc(*slot, op->size);
+            if (p || op->size == 0)
+                *slot = p;
+        }
+        else
+        {
+            if (!*slot)
+                continue;
+            mfree(*slot);
+            *slot = NULL;
+        }
+
+        double took = now_ns() - start;
+        r.total_ns += took;
+        if (took > r.max_op_ns)
+            r.max_op_ns = took;
+
+        live -= sizes[op->id];
+        sizes[op->id] = *slot ? op->size : 0;
+        live += sizes[op->id];
+        if (live > r.peak_live)
+            r.peak_live = live;
+    }
+
+    dm_get_stats(&after);
+    r.mapped_bytes = after.mapped_bytes - before.mapped_bytes;
+    r.sbrk_calls = after.sbrk_calls - before.sbrk_calls;
+    r.map_calls = after.map_calls - before.map_calls;
+
+    for (uint32_t i = 0; i < trace->slots; i++)
+        mfree(slots[i]);
+    free(slots);
+    free(sizes);
+
+    *out = r;
+    return 0;
+}
@@ -0,0 +1,57 @@
+#if !defined(DMTRACE)
+#define DMTRACE
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief one recorded allocator call.
+ * @param op 'a' mmalloc, 'f' mfree, 'r' mrelloc.
+ * @param id slot the pointer is kept in, shared by an allocation and its free.
+ * @param size requested bytes, unused for 'f'.
+ */
+typedef struct TraceOp
+{
+    char op;
+    uint32_t id;
+    size_t size;
+} TraceOp;
+
+/**
+ * @brief a whole trace, ops in call order.
+ * @param slots number of distinct ids (highest id + 1).
+ */
+typedef struct Trace
+{
+    TraceOp *ops;
+    size_t count;
+    size_t cap;
+    uint32_t slots;
+} Trace;
+
+/**
+ * @brief what replaying a trace cost.
+ * @param total_ns wall time of all ops.
+ * @param max_op_ns slowest single op.
+ * @param peak_live most payload bytes live at once.
+ * @param mapped_bytes bytes the heap took from sbrk while replaying.
+ * @param sbrk_calls times the heap grew while replaying.
+ * @param map_calls mmap, munmap and region commits while replaying.
+ */
+typedef struct ReplayResult
+{
+    double total_ns;
+    double max_op_ns;
+    size_t peak_live;
+    size_t mapped_bytes;
+    size_t sbrk_calls;
+    size_t map_calls;
+} ReplayResult;
+
+int trace_push(Trace *trace, char op, uint32_t id, size_t size);
+int trace_load(const char *path, Trace *trace);
+int trace_save(const char *path, const Trace *trace);
+void trace_free(Trace *trace);
+int trace_replay(const Trace *trace, ReplayResult *out);
+
+#endif // DMTRACE
@@ -0,0 +1,245 @@
+/*
+ * dm_tune: search allocator tunables for a recorded trace.
+ *
+ *   dm_tune [-j workers] [-r runs] trace.txt
+ *
+ * Every configuration of the grid below replays the trace in a child
+ * process of its own, up to `workers` at a time: options like `fit` or
+ * `grow` cannot be switched under a heap that is already populated.
+ * The median of `runs` replays is kept. The report lists the Pareto
+ * frontier of replay time vs. heap footprint and the DM_ALLOC_CONF
+ * string of the recommended point.
+ *
+ *   gcc -O2 -Iinclude -Itools tools/dm_tune.c tools/dm_trace.c src/dm_alloc.c -o dm_tune
+ */
+
+#include "dm_alloc.h"
+#include "dm_trace.h"
+
+#include <stdlib.h>
+#include <sys/wait.h>
+
+static const char *FITS[] = {"first", "best"};
+static const char *COALESCE[] = {"eager", "lazy"};
+static const char *GROWS[] = {"0", "4k", "64k", "1m"};
+
+#define N_FITS (sizeof(FITS) / sizeof(FITS[0]))
+#define N_COALESCE (sizeof(COALESCE) / sizeof(COALESCE[0]))
+#define N_GROWS (sizeof(GROWS) / sizeof(GROWS[0]))
+#define N_CONFIGS (N_FITS * N_COALESCE * N_GROWS)
+#define MAX_RUNS 32
+
+/**
+ * @brief one grid point and what its replays cost.
+ */
+typedef struct Candidate
+{
+    char conf[64];
+    ReplayResult runs[MAX_RUNS];
+    int done;
+    double time_ns;
+    size_t footprint;
+    int pareto;
+} Candidate;
+
+/**
+ * @brief one forked replay in flight.
+ */
+typedef struct Job
+{
+    pid_t pid;
+    int fd;
+    Candidate *cand;
+} Job;
+
+/**
+ * @brief replay in a child and send the result through a pipe.
+ */
+static int start_job(Job *job, Candidate *cand, const Trace *trace)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+        return -1;
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0)
+    {
+        ReplayResult r = {0};
+        close(fds[0]);
+        int ok = dm_configure(cand->conf) == 0 && trace_replay(trace, &r) == 0;
+        if (ok && write(fds[1], &r, sizeof(r)) != (ssize_t)sizeof(r))
+            ok = 0;
+        _exit(ok ? 0 : 1);
+    }
+
+    close(fds[1]);
+    job->pid = pid;
+    job->fd = fds[0];
+    job->cand = cand;
+    return 0;
+}
+
+/**
+ * @brief wait for `job` and store its result in its candidate.
+ */
+static int finish_job(Job *job)
+{
+    ReplayResult r;
+    ssize_t n = read(job->fd, &r, sizeof(r));
+    close(job->fd);
+    int status;
+    waitpid(job->pid, &status, 0);
+    if (n != (ssize_t)sizeof(r) || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+    job->cand->runs[job->cand->done++] = r;
+    return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief median time and worst footprint over the runs of `cand`.
+ */
+static void summarize(Candidate *cand)
+{
+    double times[MAX_RUNS];
+    cand->footprint = 0;
+    for (int i = 0; i < cand->done; i++)
+    {
+        times[i] = cand->runs[i].total_ns;
+        if (cand->runs[i].mapped_bytes > cand->footprint)
+            cand->footprint = cand->runs[i].mapped_bytes;
+    }
+    qsort(times, cand->done, sizeof(double), cmp_double);
+    cand->time_ns = cand->done ? times[cand->done / 2] : 0;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: dm_tune [-j workers] [-r runs] trace.txt\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    int workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int runs = 5;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:r:")) != -1)
+    {
+        if (opt == 'j')
+            workers = atoi(optarg);
+        else if (opt == 'r')
+            runs = atoi(optarg);
+        else
+            usage();
+    }
+    if (optind != argc - 1 || workers < 1 || runs < 1 || runs > MAX_RUNS)
+        usage();
+
+    Trace trace = {0};
+    if (trace_load(argv[optind], &trace) != 0)
+    {
+        fprintf(stderr, "dm_tune: cannot read trace %s\n", argv[optind]);
+        return 1;
+    }
+
+    static Candidate cands[N_CONFIGS];
+    size_t n = 0;
+    for (size_t f = 0; f < N_FITS; f++)
+        for (size_t c = 0; c < N_COALESCE; c++)
+            for (size_t g = 0; g < N_GROWS; g++)
+                snprintf(cands[n++].conf, sizeof(cands[0].conf), "fit:%s,coalesce:%s,grow:%s",
+                         FITS[f], COALESCE[c], GROWS[g]);
+
+    // interleave configurations across rounds so drift hits all of them alike
+    Job *jobs = calloc(workers, sizeof(Job));
+    int active = 0, failed = 0;
+    for (int round = 0; round < runs; round++)
+    {
+        for (size_t i = 0; i < N_CONFIGS; i++)
+        {
+            if (active == workers)
+            {
+                failed |= finish_job(&jobs[0]);
+                memmove(jobs, jobs + 1, (workers - 1) * sizeof(Job));
+                active--;
+            }
+            if (start_job(&jobs[active], &cands[i], &trace) == 0)
+                active++;
+            else
+                failed = -1;
+        }
+    }
+    while (active > 0)
+    {
+        failed |= finish_job(&jobs[0]);
+        memmove(jobs, jobs + 1, (active - 1) * sizeof(Job));
+        active--;
+    }
+    free(jobs);
+    if (failed)
+        fprintf(stderr, "dm_tune: some replays failed\n");
+
+    double min_time = 0;
+    size_t min_foot = 0;
+    for (size_t i = 0; i < N_CONFIGS; i++)
+    {
+        summarize(&cands[i]);
+        if (!cands[i].done)
+            continue;
+        if (min_time == 0 || cands[i].time_ns < min_time)
+            min_time = cands[i].time_ns;
+        if (min_foot == 0 || cands[i].footprint < min_foot)
+            min_foot = cands[i].footprint;
+    }
+
+    Candidate *pick = NULL;
+    double pick_score = 0;
+    printf("%-40s %14s %14s %s\n", "config", "median ms", "heap bytes", "pareto");
+    for (size_t i = 0; i < N_CONFIGS; i++)
+    {
+        Candidate *a = &cands[i];
+        if (!a->done)
+            continue;
+        a->pareto = 1;
+        for (size_t j = 0; j < N_CONFIGS && a->pareto; j++)
+        {
+            Candidate *b = &cands[j];
+            if (b == a || !b->done)
+                continue;
+            if (b->time_ns <= a->time_ns && b->footprint <= a->footprint &&
+                (b->time_ns < a->time_ns || b->footprint < a->footprint))
+                a->pareto = 0;
+        }
+        printf("%-40s %14.3f %14zu %s\n", a->conf, a->time_ns / 1e6, a->footprint,
+               a->pareto ? "*" : "");
+
+        if (a->pareto)
+        {
+            // closest to the ideal point of best time and best footprint
+            double score = a->time_ns / (min_time > 0 ? min_time : 1) +
+                           (double)a->footprint / (min_foot ? min_foot : 1);
+            if (!pick || score < pick_score)
+            {
+                pick = a;
+                pick_score = score;
+            }
+        }
+    }
+
+    if (pick)
+        printf("\nrecommended: DM_ALLOC_CONF=\"%s\"\n", pick->conf);
+    trace_free(&trace);
+    return pick ? 0 : 1;
+}